@@ -0,0 +1,575 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "config.h"
+
+#include "flash.hpp"
+#include "fwupderr.hpp"
+#include "fwupdate.hpp"
+#include "image_bios.hpp"
+#include "journal.hpp"
+#include "tracer.hpp"
+
+#ifdef INTEL_X722_SUPPORT
+#include "nvm_x722.hpp"
+#endif // INTEL_X722_SUPPORT
+
+#include <getopt.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+static constexpr size_t MiB = 1024 * 1024;
+static constexpr size_t eraseBlock = 64 * 1024;
+// Region preserved over the BIOS update, see image_bios.cpp
+static constexpr size_t nvramOffset = 0x01000000;
+static constexpr size_t nvramSize = 0x00080000;
+static constexpr auto hashFunc = "sha256";
+
+#ifdef GOLDEN_FLASH_SUPPORT
+bool useGoldenFlash = false; // Used by image_bios.cpp
+#endif // GOLDEN_FLASH_SUPPORT
+
+using Buffer = std::vector<uint8_t>;
+
+/**
+ * @brief NOR flash drive emulated in memory.
+ *        Programming can only clear bits, so the missed erase is caught by
+ *        the readback verification as on the real hardware.
+ */
+class MockFlash : public FlashIFace
+{
+  public:
+    /**
+     * @brief Constructor.
+     *
+     * @param data - flash content, kept between the openings of the drive
+     */
+    MockFlash(Buffer& data) : data(data)
+    {}
+
+    size_t size() const override
+    {
+        return data.size();
+    }
+
+    size_t eraseSize() const override
+    {
+        return eraseBlock;
+    }
+
+    void erase(size_t offset, size_t length) override
+    {
+        if (offset % eraseBlock || length % eraseBlock ||
+            offset + length > data.size())
+        {
+            throw FwupdateError("Unaligned erase: 0x%zx+0x%zx", offset,
+                                length);
+        }
+        std::fill_n(data.begin() + offset, length, 0xff);
+    }
+
+    void write(size_t offset, const void* buf, size_t length) override
+    {
+        const auto* src = static_cast<const uint8_t*>(buf);
+        for (size_t i = 0; i < length; ++i)
+        {
+            data[offset + i] &= src[i];
+        }
+    }
+
+    void read(size_t offset, void* buf, size_t length) override
+    {
+        std::copy_n(data.begin() + offset, length, static_cast<uint8_t*>(buf));
+    }
+
+  private:
+    Buffer& data; //! Flash content
+};
+
+/**
+ * @brief BIOS updater writing the emulated host flash.
+ *        The GPIO lines are never touched: the package is installed with
+ *        the force flag, so the flash is not locked.
+ */
+struct BenchBIOSUpdater : public BIOSUpdater
+{
+    /**
+     * @brief Constructor.
+     *
+     * @param tmpdir - temporary directory of the package
+     * @param flash  - content of the emulated host flash
+     */
+    BenchBIOSUpdater(const fs::path& tmpdir, Buffer& flash) :
+        BIOSUpdater(tmpdir), flash(flash)
+    {}
+
+    bool doAfterInstall(bool /*reset*/) override
+    {
+        // The version stored on D-Bus is not reset in the benchmark
+        return false;
+    }
+
+  protected:
+    std::unique_ptr<FlashIFace> openFlash(const fs::path& /*device*/) override
+    {
+        return std::make_unique<MockFlash>(flash);
+    }
+
+  private:
+    Buffer& flash; //! Content of the emulated host flash
+};
+
+/**
+ * @brief Firmware updater trusting the key of the benchmark.
+ */
+struct BenchUpdate : public FwUpdate
+{
+    /**
+     * @brief Constructor.
+     *
+     * @param factory   - function to create the updaters
+     * @param systemKey - path to the public key of the system
+     */
+    BenchUpdate(const UpdaterFactory& factory, const fs::path& systemKey) :
+        FwUpdate(true, factory), keys{{systemKey, ::hashFunc}}
+    {}
+
+  protected:
+    const std::vector<SystemKey>& getSystemKeys() override
+    {
+        return keys;
+    }
+
+    void storeIndex() override
+    {
+        // The index key of the system must not be created by the benchmark
+    }
+
+  private:
+    std::vector<SystemKey> keys; //! Keys of the emulated system
+};
+
+/**
+ * @brief Result of the benchmark stage.
+ */
+struct StageResult
+{
+    std::string name; //! Stage name
+    size_t bytes;     //! Amount of processed data
+    double duration;  //! Duration in seconds
+};
+
+static std::vector<StageResult> results;
+
+/**
+ * @brief Run the benchmark stage and record its duration.
+ *
+ * @param name  - stage name
+ * @param bytes - amount of data processed by the stage
+ * @param stage - function to run, it gets the tracer of the stage
+ */
+static void runStage(const char* name, size_t bytes,
+                     const std::function<void(Tracer&)>& stage)
+{
+    using seconds = std::chrono::duration<double>;
+
+    Tracer tracer(name);
+    tracer.addBytes(bytes);
+    const auto start = std::chrono::steady_clock::now();
+    stage(tracer);
+    const auto end = std::chrono::steady_clock::now();
+    tracer.done();
+
+    results.push_back({name, bytes, seconds(end - start).count()});
+}
+
+/**
+ * @brief Write the file member of the TAR archive.
+ */
+static void writeTarMember(std::ofstream& out, const std::string& name,
+                           const Buffer& data)
+{
+    constexpr size_t blockSize = 512;
+    char hdr[blockSize] = {};
+
+    snprintf(hdr, 100, "%s", name.c_str());
+    snprintf(hdr + 100, 8, "%07o", 0644);
+    snprintf(hdr + 108, 8, "%07o", 0);
+    snprintf(hdr + 116, 8, "%07o", 0);
+    snprintf(hdr + 124, 12, "%011zo", data.size());
+    snprintf(hdr + 136, 12, "%011o", 0);
+    hdr[156] = '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    // Checksum is calculated with chksum field filled by spaces
+    memset(hdr + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (const auto c : hdr)
+    {
+        sum += static_cast<unsigned char>(c);
+    }
+    snprintf(hdr + 148, 8, "%06o", sum);
+
+    out.write(hdr, sizeof(hdr));
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    const std::vector<char> pad((blockSize - data.size() % blockSize) %
+                                blockSize);
+    out.write(pad.data(), pad.size());
+}
+
+using Key = std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)>;
+
+/**
+ * @brief Create the key pair.
+ *
+ * @return Private key
+ */
+static Key createKey()
+{
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)> keyCtx(
+        EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), &::EVP_PKEY_CTX_free);
+    EVP_PKEY* rawKey = nullptr;
+    if (!keyCtx || EVP_PKEY_keygen_init(keyCtx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx.get(), 2048) != 1 ||
+        EVP_PKEY_keygen(keyCtx.get(), &rawKey) != 1)
+    {
+        throw FwupdateError("Unable to generate the key");
+    }
+    return Key(rawKey, &::EVP_PKEY_free);
+}
+
+/**
+ * @brief Get the public key in PEM format.
+ */
+static Buffer getPublicKey(EVP_PKEY* key)
+{
+    std::unique_ptr<BIO, decltype(&::BIO_free)> bio(BIO_new(BIO_s_mem()),
+                                                    &::BIO_free);
+    char* pem = nullptr;
+    long len = 0;
+    if (!bio || PEM_write_bio_PUBKEY(bio.get(), key) != 1 ||
+        (len = BIO_get_mem_data(bio.get(), &pem)) <= 0)
+    {
+        throw FwupdateError("Unable to write the public key");
+    }
+    return Buffer(pem, pem + len);
+}
+
+/**
+ * @brief Sign the data.
+ *
+ * @param key  - private key
+ * @param data - data to sign
+ *
+ * @return Signature
+ */
+static Buffer sign(EVP_PKEY* key, const Buffer& data)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> signCtx(
+        EVP_MD_CTX_new(), &::EVP_MD_CTX_free);
+    size_t sigSize = 0;
+    if (!signCtx ||
+        EVP_DigestSignInit(signCtx.get(), nullptr,
+                           EVP_get_digestbyname(hashFunc), nullptr,
+                           key) != 1 ||
+        EVP_DigestSignUpdate(signCtx.get(), data.data(), data.size()) != 1 ||
+        EVP_DigestSignFinal(signCtx.get(), nullptr, &sigSize) != 1)
+    {
+        throw FwupdateError("Unable to sign the data");
+    }
+    Buffer sig(sigSize);
+    if (EVP_DigestSignFinal(signCtx.get(), sig.data(), &sigSize) != 1)
+    {
+        throw FwupdateError("Unable to sign the data");
+    }
+    sig.resize(sigSize);
+    return sig;
+}
+
+/**
+ * @brief Write the signed firmware package.
+ *        The same key is used for the package and the image signatures.
+ *
+ * @param bundle - path to the package
+ * @param key    - private key
+ * @param image  - BIOS image
+ */
+static void writeBundle(const fs::path& bundle, EVP_PKEY* key,
+                        const Buffer& image)
+{
+    const std::string manifest = "HashType=" + std::string(hashFunc) + "\n";
+    const std::vector<std::pair<std::string, Buffer>> files = {
+        {MANIFEST_FILE_NAME, Buffer(manifest.begin(), manifest.end())},
+        {PUBLICKEY_FILE_NAME, getPublicKey(key)},
+    };
+
+    std::ofstream out(bundle, std::ios::binary);
+    for (const auto& [name, data] : files)
+    {
+        writeTarMember(out, name, data);
+        writeTarMember(out, name + SIGNATURE_FILE_EXT, sign(key, data));
+    }
+    writeTarMember(out, "vegman.bin", image);
+    writeTarMember(out, "vegman.bin" SIGNATURE_FILE_EXT, sign(key, image));
+
+    const Buffer end(1024);
+    out.write(reinterpret_cast<const char*>(end.data()), end.size());
+    if (!out)
+    {
+        throw FwupdateError("Unable to write %s", bundle.c_str());
+    }
+}
+
+#ifdef INTEL_X722_SUPPORT
+/**
+ * @brief Build the 10GBE NVM image with the valid bank.
+ */
+static Buffer createNvm()
+{
+    using word_t = NvmX722::word_t;
+
+    Buffer nvm(NvmX722::nvmSize);
+    RAND_bytes(nvm.data(), nvm.size());
+
+    // Place the MAC settings right after the pointers
+    auto setWord = [&nvm](size_t offset, word_t value) {
+        memcpy(nvm.data() + offset * sizeof(word_t), &value, sizeof(value));
+    };
+    constexpr word_t macBase = 0x100;
+    setWord(NvmX722::controlWord, NvmX722::bankValid);
+    setWord(NvmX722::magicOffset1, macBase);
+    setWord(macBase + NvmX722::magicOffset2, 0x20);
+
+    return nvm;
+}
+#endif // INTEL_X722_SUPPORT
+
+/**
+ * @brief Print usage
+ */
+static void printUsage(const char* app)
+{
+    printf("\nUsage: %s [-h] [-s SIZE] [-S FILE]\n", app);
+    printf(R"(optional arguments:
+  -h, --help        show this help message and exit
+  -s, --size SIZE   size of the synthetic image in MiB (default 32)
+  -S, --stats FILE  append duration and throughput of each step to the file
+                    as JSON lines
+)");
+}
+
+int main(int argc, char* argv[])
+{
+    /* Disable buffering on stdout */
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    const struct option opts[] = {
+        // clang-format off
+        { "help",  no_argument,       0, 'h' },
+        { "size",  required_argument, 0, 's' },
+        { "stats", required_argument, 0, 'S' },
+        { 0,       0,                 0,  0  }
+        // clang-format on
+    };
+
+    size_t imageSize = 32 * MiB;
+    std::string statsFile;
+
+    opterr = 0;
+    int optVal;
+    while ((optVal = getopt_long(argc, argv, "hs:S:", opts, nullptr)) != -1)
+    {
+        switch (optVal)
+        {
+            case 'h':
+                printUsage(argv[0]);
+                return EXIT_SUCCESS;
+
+            case 's':
+                imageSize = strtoul(optarg, nullptr, 0) * MiB;
+                break;
+
+            case 'S':
+                statsFile = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "Invalid option: %s\n", argv[optind - 1]);
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (imageSize < nvramOffset + nvramSize)
+    {
+        fprintf(stderr, "The image must be at least %zu MiB\n",
+                (nvramOffset + nvramSize + MiB - 1) / MiB);
+        return EXIT_FAILURE;
+    }
+
+    FILE* stats = nullptr;
+    if (!statsFile.empty())
+    {
+        stats = fopen(statsFile.c_str(), "ae");
+        if (!stats)
+        {
+            fprintf(stderr, "Unable to open %s: %s\n", statsFile.c_str(),
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        Tracer::setStatsFile(stats);
+    }
+
+    std::string tmpdir(fs::temp_directory_path() / "fwupdate-benchXXXXXX");
+    if (!mkdtemp(tmpdir.data()))
+    {
+        fprintf(stderr, "mkdtemp() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int rc = EXIT_SUCCESS;
+    try
+    {
+        const fs::path dir(tmpdir);
+        WriteJournal::directory = dir / "journal";
+
+        const auto key = createKey();
+        const fs::path systemKey(dir / "system.pem");
+        {
+            const auto pem = getPublicKey(key.get());
+            std::ofstream out(systemKey, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(pem.data()), pem.size());
+        }
+
+        // Synthetic BIOS image and the host flash with the previous firmware
+        Buffer image(imageSize);
+        RAND_bytes(image.data(), image.size());
+        Buffer hostFlash(imageSize);
+        RAND_bytes(hostFlash.data(), hostFlash.size());
+#ifdef INTEL_X722_SUPPORT
+        auto nvm = createNvm();
+        std::copy(nvm.begin(), nvm.end(), image.begin() + NvmX722::nvmOffset);
+        std::copy(nvm.begin(), nvm.end(),
+                  hostFlash.begin() + NvmX722::nvmOffset);
+#endif // INTEL_X722_SUPPORT
+        const Buffer nvram(hostFlash.begin() + nvramOffset,
+                           hostFlash.begin() + nvramOffset + nvramSize);
+
+        const fs::path bundle(dir / "bundle.tar");
+        writeBundle(bundle, key.get(), image);
+
+        BenchBIOSUpdater* bios = nullptr;
+        BenchUpdate fwupdate(
+            [&](const fs::path& pkgdir) {
+                FwUpdate::Updaters updaters;
+                auto updater =
+                    std::make_unique<BenchBIOSUpdater>(pkgdir, hostFlash);
+                bios = updater.get();
+                updaters.emplace_back(std::move(updater));
+                return updaters;
+            },
+            systemKey);
+
+        runStage("Unpack bundle", fs::file_size(bundle),
+                 [&](Tracer&) { fwupdate.unpack(bundle); });
+
+        runStage("Verify signature", imageSize,
+                 [&](Tracer&) { fwupdate.verify(); });
+
+#ifdef INTEL_X722_SUPPORT
+        constexpr size_t macIterations = 100;
+        runStage("Patch x722 MAC", macIterations * NvmX722::bankSize,
+                 [&](Tracer&) {
+                     NvmX722 gbe(nvm.data(), nvm.size());
+                     for (size_t i = 0; i < macIterations; ++i)
+                     {
+                         auto mac = gbe.getMac();
+                         mac[0][5] = static_cast<uint8_t>(i);
+                         gbe.setMac(mac);
+                     }
+                 });
+#endif // INTEL_X722_SUPPORT
+
+        runStage("Preserve NVRAM", nvramSize,
+                 [&](Tracer&) { bios->doBeforeInstall(false); });
+
+        // Each installation preserves NVRAM, composes the image and writes
+        // it through the updater, the steps are traced by the updater.
+        auto install = [&](const char* name) {
+            runStage(name, imageSize,
+                     [&](Tracer&) { fwupdate.install(false); });
+            if (!std::equal(nvram.begin(), nvram.end(),
+                            hostFlash.begin() + nvramOffset))
+            {
+                throw FwupdateError("NVRAM is not preserved by %s", name);
+            }
+        };
+
+        install("Install firmware");
+
+        for (const auto& [name, mode] :
+             {std::make_pair("Install [digest]", FlashVerify::digest),
+              std::make_pair("Install [sample]", FlashVerify::sample)})
+        {
+            FwUpdBase::flashOptions.verify = mode;
+            install(name);
+        }
+        FwUpdBase::flashOptions = FlashOptions();
+
+        FwUpdBase::flashOptions.incremental = true;
+        install("Install unchanged");
+
+        // One changed byte per megabyte
+        for (size_t pos = 0; pos < image.size(); pos += MiB)
+        {
+            image[pos] ^= 0xff;
+        }
+        writeBundle(bundle, key.get(), image);
+        fwupdate.unpack(bundle);
+        fwupdate.verify();
+        install("Install sparse changes");
+
+        printf("\n%-24s %10s %10s %10s\n", "Stage", "MiB", "Seconds",
+               "MiB/s");
+        for (const auto& result : results)
+        {
+            const double size = static_cast<double>(result.bytes) / MiB;
+            printf("%-24s %10.1f %10.3f %10.1f\n", result.name.c_str(), size,
+                   result.duration,
+                   result.duration > 0 ? size / result.duration : 0);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        rc = EXIT_FAILURE;
+    }
+
+    std::error_code ec;
+    fs::remove_all(tmpdir, ec);
+    if (stats)
+    {
+        fclose(stats);
+    }
+
+    return rc;
+}
@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "dbus.hpp"
+
+#include "fwupderr.hpp"
+
+// The benchmark doesn't connect to the bus, the pipeline stages under test
+// must not use it.
+sdbusplus::bus::bus systemBus(nullptr);
+std::recursive_mutex systemBusMutex;
+
+/**
+ * @brief Report unexpected use of the bus.
+ */
+[[noreturn]] static void noBus()
+{
+    throw FwupdateError("D-Bus is not available in the benchmark");
+}
+
+Objects getObjects(const Path&, const Interfaces&)
+{
+    noBus();
+}
+
+ObjectsMap getSubTree(const Path&, const Interfaces&, int32_t)
+{
+    noBus();
+}
+
+bool doesUnitExist(const std::string&)
+{
+    noBus();
+}
+
+void startUnit(const std::string&)
+{
+    noBus();
+}
+
+void stopUnit(const std::string&)
+{
+    noBus();
+}
+
+void stopUnits(const std::vector<std::string>&)
+{
+    noBus();
+}
+
+void callBatch(
+    std::vector<sdbusplus::message::message>&,
+    const std::function<void(size_t, sdbusplus::message::message&)>&,
+    uint64_t)
+{
+    noBus();
+}
+
+bool isChassisOn()
+{
+    noBus();
+}
@@ -0,0 +1,319 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "config.h"
+
+#include "bundleindex.hpp"
+
+#include "fwupderr.hpp"
+#include "strfmt.hpp"
+
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static constexpr size_t indexKeySize = 32;
+static constexpr auto hmacTag = "hmac ";
+static constexpr auto keyTag = "key ";
+
+/**
+ * @brief Describe the file identity: any change of the file content updates
+ *        its ctime, which can't be set by user.
+ *
+ * @param tag  - record tag
+ * @param file - path to the file
+ * @param st   - status of the file
+ *
+ * @return Description line
+ */
+static std::string describeStat(const char* tag, const fs::path& file,
+                                const struct stat& st)
+{
+    // strfmt keeps the terminating null, it is dropped by c_str()
+    return strfmt("%s%s %ju %ju %jd %jd.%09ld %jd.%09ld\n", tag, file.c_str(),
+                  static_cast<uintmax_t>(st.st_dev),
+                  static_cast<uintmax_t>(st.st_ino),
+                  static_cast<intmax_t>(st.st_size),
+                  static_cast<intmax_t>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec,
+                  static_cast<intmax_t>(st.st_ctim.tv_sec), st.st_ctim.tv_nsec)
+        .c_str();
+}
+
+/**
+ * @brief Describe the file identity by path.
+ *
+ * @param tag  - record tag
+ * @param file - path to the file
+ *
+ * @return Description line, empty string if the file doesn't exist
+ */
+static std::string describeFile(const char* tag, const fs::path& file)
+{
+    struct stat st;
+    if (stat(file.c_str(), &st) == -1)
+    {
+        return {};
+    }
+    return describeStat(tag, file, st);
+}
+
+/**
+ * @brief Describe the unpacked members of the bundle.
+ *
+ * @param dir - directory with the unpacked members
+ *
+ * @return Description lines sorted by the member name
+ */
+static std::string describeMembers(const fs::path& dir)
+{
+    std::vector<std::string> lines;
+    for (const auto& it : fs::directory_iterator(dir))
+    {
+        if (it.is_regular_file())
+        {
+            lines.emplace_back(strfmt("member %s %ju\n",
+                                      it.path().filename().c_str(),
+                                      static_cast<uintmax_t>(it.file_size()))
+                                   .c_str());
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+
+    std::string ret;
+    for (const auto& line : lines)
+    {
+        ret += line;
+    }
+    return ret;
+}
+
+/**
+ * @brief Get the key for the index HMAC.
+ *
+ * @param create - flag to generate the key if it doesn't exist
+ *
+ * @return Key value, empty string if the key is not available
+ */
+static std::string getIndexKey(bool create)
+{
+    const fs::path keyFile(BUNDLE_INDEX_KEY);
+
+    int fd = open(keyFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT && create)
+    {
+        unsigned char key[indexKeySize];
+        if (RAND_bytes(key, sizeof(key)) != 1)
+        {
+            return {};
+        }
+
+        mkdir(keyFile.parent_path().c_str(), 0700);
+        fd = open(keyFile.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0600);
+        if (fd != -1 && (write(fd, key, sizeof(key)) != sizeof(key) ||
+                         lseek(fd, 0, SEEK_SET) != 0))
+        {
+            close(fd);
+            unlink(keyFile.c_str());
+            return {};
+        }
+    }
+    if (fd == -1)
+    {
+        return {};
+    }
+
+    // The key must not be accessible by anyone except root
+    std::string key(indexKeySize, '\0');
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_uid != 0 || (st.st_mode & 077) ||
+        read(fd, key.data(), key.size()) != static_cast<ssize_t>(key.size()))
+    {
+        key.clear();
+    }
+    close(fd);
+
+    return key;
+}
+
+/**
+ * @brief Calculate HMAC of the index content.
+ *
+ * @param key  - HMAC key
+ * @param data - index content
+ *
+ * @return HMAC value as hex string
+ */
+static std::string calcHmac(const std::string& key, const std::string& data)
+{
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int macLen = 0;
+    if (!HMAC(EVP_sha256(), key.data(), key.size(),
+              reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+              mac, &macLen))
+    {
+        return {};
+    }
+
+    std::string ret;
+    for (unsigned int i = 0; i < macLen; ++i)
+    {
+        ret += strfmt("%02x", mac[i]).c_str();
+    }
+    return ret;
+}
+
+BundleIndex::BundleIndex(const fs::path& path) :
+    bundle(fs::absolute(path)),
+    indexFile(fs::absolute(path).concat(BUNDLE_INDEX_EXT)),
+    bundleFd(open(path.c_str(), O_RDONLY | O_CLOEXEC)), bundleSize(0),
+    trusted(false)
+{
+    struct stat st;
+    if (bundleFd == -1 || fstat(bundleFd, &st) == -1)
+    {
+        const int err = errno;
+        if (bundleFd != -1)
+        {
+            close(bundleFd);
+        }
+        throw FwupdateError("open %s failed, error=%d: %s", path.c_str(), err,
+                            strerror(err));
+    }
+    posix_fadvise(bundleFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bundleSize = st.st_size;
+    identity = describeStat("bundle ", bundle, st);
+
+    std::ifstream file(indexFile, std::ios::binary);
+    const std::string content((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+    if (content.empty())
+    {
+        return;
+    }
+
+    // The last line is HMAC of the rest index
+    const size_t hmacPos = content.rfind(hmacTag);
+    if (hmacPos == std::string::npos ||
+        (hmacPos != 0 && content[hmacPos - 1] != '\n'))
+    {
+        return;
+    }
+    const std::string body = content.substr(0, hmacPos);
+    std::string hmac = content.substr(hmacPos + strlen(hmacTag));
+    hmac.erase(hmac.find_last_not_of('\n') + 1);
+
+    const std::string key = getIndexKey(false);
+    if (key.empty())
+    {
+        return;
+    }
+    const std::string expected = calcHmac(key, body);
+    if (expected.empty() || expected.size() != hmac.size() ||
+        CRYPTO_memcmp(expected.data(), hmac.data(), hmac.size()) != 0)
+    {
+        return;
+    }
+
+    // The bundle line is followed by the system key line
+    if (body.compare(0, identity.size(), identity))
+    {
+        return;
+    }
+    const size_t keyPos = identity.size();
+    if (body.compare(keyPos, strlen(keyTag), keyTag))
+    {
+        return;
+    }
+    const size_t keyPathPos = keyPos + strlen(keyTag);
+    const size_t keyPathEnd = body.find(' ', keyPathPos);
+    if (keyPathEnd == std::string::npos)
+    {
+        return;
+    }
+    const std::string keyLine = describeFile(
+        keyTag, body.substr(keyPathPos, keyPathEnd - keyPathPos));
+    if (keyLine.empty() || body.compare(keyPos, keyLine.size(), keyLine))
+    {
+        return;
+    }
+
+    members = body.substr(keyPos + keyLine.size());
+    trusted = true;
+}
+
+BundleIndex::~BundleIndex()
+{
+    close(bundleFd);
+}
+
+bool BundleIndex::isUnchanged() const
+{
+    struct stat st;
+    return fstat(bundleFd, &st) == 0 &&
+           describeStat("bundle ", bundle, st) == identity;
+}
+
+bool BundleIndex::isVerified(const fs::path& dir) const
+{
+    return trusted && isUnchanged() && describeMembers(dir) == members;
+}
+
+void BundleIndex::store(const fs::path& dir,
+                        const fs::path& systemKey) const noexcept
+{
+    try
+    {
+        // The bundle which was changed while it was read is not trusted
+        if (!isUnchanged())
+        {
+            return;
+        }
+        const std::string key = getIndexKey(true);
+        const std::string keyLine = describeFile(keyTag, systemKey);
+        if (key.empty() || keyLine.empty())
+        {
+            return;
+        }
+
+        const std::string body = identity + keyLine + describeMembers(dir);
+        const std::string hmac = calcHmac(key, body);
+        if (hmac.empty())
+        {
+            return;
+        }
+
+        // Replace the index atomically
+        fs::path tmpFile(indexFile);
+        tmpFile += ".tmp";
+        {
+            std::ofstream file(tmpFile, std::ios::binary | std::ios::trunc);
+            file << body << hmacTag << hmac << '\n';
+            file.close();
+            if (!file)
+            {
+                std::error_code ec;
+                fs::remove(tmpFile, ec);
+                return;
+            }
+        }
+        fs::rename(tmpFile, indexFile);
+    }
+    catch (...)
+    {
+        // The index is not mandatory
+    }
+}
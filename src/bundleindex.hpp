@@ -0,0 +1,106 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Index of the verified firmware bundle.
+ *        The index is written next to the bundle after successful signature
+ *        verification. It describes the bundle file (device, inode, size and
+ *        timestamps), the system key used for the check and the unpacked
+ *        members. The index is protected by HMAC with the key accessible
+ *        only by root, so the signatures of unchanged bundle aren't checked
+ *        again.
+ *
+ *        The bundle is opened by the index and must be read only through
+ *        its descriptor: the identity is taken from the opened file once and
+ *        the same snapshot is stored after the verification, so a bundle
+ *        replaced by path can't be recorded as verified.
+ */
+class BundleIndex
+{
+  public:
+    BundleIndex(const BundleIndex&) = delete;
+    BundleIndex& operator=(const BundleIndex&) = delete;
+
+    /**
+     * @brief Open the bundle and load its index.
+     *
+     * @param bundle - path to the firmware bundle
+     *
+     * @throw FwupdateError if the bundle can't be opened
+     */
+    BundleIndex(const fs::path& bundle);
+
+    /**
+     * @brief Close the bundle.
+     */
+    ~BundleIndex();
+
+    /**
+     * @brief Get descriptor of the opened bundle.
+     */
+    int fd() const
+    {
+        return bundleFd;
+    }
+
+    /**
+     * @brief Get size of the opened bundle.
+     */
+    size_t size() const
+    {
+        return bundleSize;
+    }
+
+    /**
+     * @brief Check if the bundle and the system key weren't changed since
+     *        the last successful verification.
+     */
+    bool isTrusted() const
+    {
+        return trusted;
+    }
+
+    /**
+     * @brief Check if the unpacked members match the index.
+     *
+     * @param dir - directory with the unpacked members
+     *
+     * @return true if the bundle is trusted, was not changed while it was
+     *         read, and has the same members
+     */
+    bool isVerified(const fs::path& dir) const;
+
+    /**
+     * @brief Write the index of the verified bundle.
+     *        The index is not written if the bundle was changed since it
+     *        was opened. Errors are ignored: the index is only an
+     *        optimization.
+     *
+     * @param dir       - directory with the unpacked members
+     * @param systemKey - path to the system public key used for the check
+     */
+    void store(const fs::path& dir, const fs::path& systemKey) const noexcept;
+
+  private:
+    /**
+     * @brief Check if the opened bundle is not changed since it was opened.
+     */
+    bool isUnchanged() const;
+
+    fs::path bundle;      //! Path to the bundle
+    fs::path indexFile;   //! Path to the index file
+    int bundleFd;         //! Descriptor of the opened bundle
+    size_t bundleSize;    //! Size of the opened bundle
+    std::string identity; //! Bundle description taken on open
+    bool trusted;         //! Bundle is not changed since the verification
+    std::string members;  //! Members description from the loaded index
+};
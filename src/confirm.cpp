@@ -5,18 +5,47 @@
 
 #include "confirm.hpp"
 
+#include "parser.hpp"
+
+#include <cctype>
 #include <cstdio>
 #include <iostream>
-#include <regex>
 #include <string>
 
-static const std::regex yesno("^\\s*(y|n|yes|no)(\\s+.*)?$", std::regex::icase);
+/**
+ * @brief Get the answer from the first word of the line.
+ *
+ * @param line - user input
+ *
+ * @return 'y' or 'n', zero if the answer is not recognized
+ */
+static char parseAnswer(std::string_view line)
+{
+    static constexpr std::array<std::string_view, 4> answers = {
+        "y",
+        "n",
+        "yes",
+        "no",
+    };
+
+    std::array<std::string_view, 1> word;
+    if (splitFields(line, word) != word.size() || word[0].size() > 3)
+    {
+        return 0;
+    }
+
+    std::string lower(word[0]);
+    for (auto& c : lower)
+    {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return isOneOf(lower, answers) ? lower[0] : 0;
+}
 
 bool confirm(const char* title, const char* prompt)
 {
     printf("%s\n", title);
     std::string answer;
-    std::smatch match;
 
     while (true)
     {
@@ -28,10 +57,10 @@ bool confirm(const char* title, const char* prompt)
                 break;
             }
 
-            if (std::regex_match(answer, match, yesno))
+            const char c = parseAnswer(answer);
+            if (c)
             {
-                const auto& c = match[1].str()[0];
-                return (c == 'y' || c == 'Y');
+                return c == 'y';
             }
         }
         else
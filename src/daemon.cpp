@@ -0,0 +1,327 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "config.h"
+
+#include "daemon.hpp"
+
+#include "fwupdate.hpp"
+#include "fwupdbase.hpp"
+#include "fwupderr.hpp"
+#include "tracer.hpp"
+
+#include <sdbusplus/bus/match.hpp>
+#include <systemd/sd-bus.h>
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+
+static constexpr auto daemonError = DAEMON_INTERFACE ".Error.Failed";
+
+/**
+ * @brief State of the service kept between the requests.
+ */
+struct DaemonState
+{
+    sdbusplus::bus::bus bus;  //! Service connection
+    FwUpdate fwupdate{false}; //! Updaters reused by the requests
+    bool prepared = false;    //! Verified firmware package is unpacked
+};
+
+/**
+ * @brief Call the method handler and convert exceptions to D-Bus errors.
+ *
+ * @param msg     - method call
+ * @param error   - D-Bus error to fill
+ * @param handler - function to handle the request and fill the reply
+ *
+ * @return sd-bus method handler status
+ */
+template <typename Handler>
+static int handleMethod(sd_bus_message* msg, sd_bus_error* error,
+                        Handler&& handler)
+{
+    // The requests install firmware and access the flash as root, only
+    // root is allowed to send them. The credentials are taken from the bus
+    // driver, not from the racy /proc of the caller.
+    sd_bus_creds* creds = nullptr;
+    uid_t euid = 0;
+    const int rc = sd_bus_query_sender_creds(msg, SD_BUS_CREDS_EUID, &creds);
+    if (rc < 0)
+    {
+        return sd_bus_error_set_errno(error, rc);
+    }
+    const int credsRc = sd_bus_creds_get_euid(creds, &euid);
+    sd_bus_creds_unref(creds);
+    if (credsRc < 0 || euid != 0)
+    {
+        return sd_bus_error_set(error, SD_BUS_ERROR_ACCESS_DENIED,
+                                "Only root is allowed to update firmware");
+    }
+
+    try
+    {
+        sdbusplus::message::message req(msg);
+        auto reply = req.new_method_return();
+        handler(req, reply);
+        reply.method_return();
+        return 1;
+    }
+    catch (const std::exception& e)
+    {
+        return sd_bus_error_set(error, daemonError, e.what());
+    }
+}
+
+/**
+ * @brief Verify(s package, b force, b skipSignCheck,
+ *               b skipMachineTypeCheck, b pipeline)
+ *        Unpack and verify the firmware package, keep it for installation.
+ */
+static int methodVerify(sd_bus_message* msg, void* userdata,
+                        sd_bus_error* error)
+{
+    auto state = static_cast<DaemonState*>(userdata);
+    return handleMethod(msg, error, [state](auto& req, auto&) {
+        std::string package;
+        bool force, skipSignCheck, skipMachineTypeCheck, pipeline;
+        req.read(package, force, skipSignCheck, skipMachineTypeCheck,
+                 pipeline);
+
+        state->prepared = false;
+
+        auto& fwupdate = state->fwupdate;
+        fwupdate.setForce(force);
+        try
+        {
+            fwupdate.unpack(package);
+            if (!skipSignCheck)
+            {
+                fwupdate.verify(pipeline);
+            }
+            if (!skipMachineTypeCheck)
+            {
+                fwupdate.checkMachineType();
+            }
+        }
+        catch (...)
+        {
+            // The package which failed the checks is not kept
+            fwupdate.clearPackage();
+            throw;
+        }
+
+        state->prepared = true;
+    });
+}
+
+/**
+ * @brief Install(b reset, b incremental, s verify) -> b rebootRequired
+ *        Install the firmware package verified by the last Verify call.
+ */
+static int methodInstall(sd_bus_message* msg, void* userdata,
+                         sd_bus_error* error)
+{
+    auto state = static_cast<DaemonState*>(userdata);
+    return handleMethod(msg, error, [state](auto& req, auto& reply) {
+        bool reset, incremental;
+        std::string verify;
+        req.read(reset, incremental, verify);
+
+        if (!state->prepared)
+        {
+            throw FwupdateError("No verified firmware package");
+        }
+
+        // The package is removed even if installation failed
+        state->prepared = false;
+        auto& fwupdate = state->fwupdate;
+        FwUpdBase::flashOptions.incremental = incremental;
+        FwUpdBase::flashOptions.verify = getFlashVerify(verify);
+        bool rebootRequired;
+        try
+        {
+            rebootRequired = fwupdate.install(reset);
+        }
+        catch (...)
+        {
+            fwupdate.clearPackage();
+            throw;
+        }
+        fwupdate.clearPackage();
+        reply.append(rebootRequired);
+    });
+}
+
+/**
+ * @brief Reset(b force)
+ *        Reset all settings to manufacturing default.
+ */
+static int methodReset(sd_bus_message* msg, void* userdata,
+                       sd_bus_error* error)
+{
+    auto state = static_cast<DaemonState*>(userdata);
+    return handleMethod(msg, error, [state](auto& req, auto&) {
+        bool force;
+        req.read(force);
+        state->fwupdate.setForce(force);
+        state->fwupdate.reset();
+    });
+}
+
+#ifdef INTEL_C62X_SUPPORT
+/**
+ * @brief ReadNvram(b force) -> ay dump
+ *        Read NVRAM, the dump is written to the file by the caller.
+ */
+static int methodReadNvram(sd_bus_message* msg, void* userdata,
+                           sd_bus_error* error)
+{
+    auto state = static_cast<DaemonState*>(userdata);
+    return handleMethod(msg, error, [state](auto& req, auto& reply) {
+        bool force;
+        req.read(force);
+        state->fwupdate.setForce(force);
+        reply.append(state->fwupdate.readNvram());
+    });
+}
+#endif // INTEL_C62X_SUPPORT
+
+void runDaemon()
+{
+    static const sd_bus_vtable vtable[] = {
+        // clang-format off
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Verify",    "sbbbb", "",   methodVerify,    0),
+        SD_BUS_METHOD("Install",   "bbs",   "b",  methodInstall,   0),
+        SD_BUS_METHOD("Reset",     "b",     "",   methodReset,     0),
+#ifdef INTEL_C62X_SUPPORT
+        SD_BUS_METHOD("ReadNvram", "b",     "ay", methodReadNvram, 0),
+#endif // INTEL_C62X_SUPPORT
+        SD_BUS_SIGNAL("Progress",  "ss",    0),
+        SD_BUS_VTABLE_END
+        // clang-format on
+    };
+
+    // The service uses its own connection: the updaters make calls on the
+    // system bus connection while the request is being handled.
+    DaemonState state{sdbusplus::bus::new_system()};
+
+    sd_bus_slot* slot = nullptr;
+    const int rc =
+        sd_bus_add_object_vtable(state.bus.get(), &slot, DAEMON_PATH,
+                                 DAEMON_INTERFACE, vtable, &state);
+    if (rc < 0)
+    {
+        throw FwupdateError("Unable to register %s object: %s", DAEMON_PATH,
+                            strerror(-rc));
+    }
+    state.bus.request_name(DAEMON_BUSNAME);
+
+    // The installation of several flash drives traces from several threads,
+    // while the dispatching thread waits for them inside the handler
+    std::mutex signalMutex;
+    Tracer::setListener([&state, &signalMutex](const std::string& title,
+                                               const std::string& status) {
+        std::lock_guard<std::mutex> lock(signalMutex);
+        sd_bus_emit_signal(state.bus.get(), DAEMON_PATH, DAEMON_INTERFACE,
+                           "Progress", "ss", title.c_str(), status.c_str());
+    });
+
+    printf("Waiting for requests on %s\n", DAEMON_BUSNAME);
+    while (true)
+    {
+        state.bus.process_discard();
+        state.bus.wait();
+    }
+}
+
+bool isDaemonRunning()
+{
+    BusLock busLock(systemBusMutex);
+    auto req = systemBus.new_method_call(
+        "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+        "NameHasOwner");
+    req.append(DAEMON_BUSNAME);
+
+    bool running = false;
+    try
+    {
+        systemBus.call(req).read(running);
+    }
+    catch (const sdbusplus::exception::SdBusError&)
+    {
+        running = false;
+    }
+
+    return running;
+}
+
+/**
+ * @brief Print the progress of the service task in the Tracer's format.
+ *
+ * @param title - task title
+ * @param state - task state
+ */
+static void printProgress(const std::string& title, const std::string& state)
+{
+    if (state.empty())
+    {
+        const int offset = title.size();
+        printf("%s %*s ", title.c_str(), offset - TITLE_WIDTH, "...");
+    }
+    else if (state.back() == '%')
+    {
+        printf("%4s\b\b\b\b", state.c_str());
+    }
+    else
+    {
+        printf("[%s]\n", state == "OK" ? " OK " : state.c_str());
+    }
+}
+
+sdbusplus::message::message callDaemonMethod(sdbusplus::message::message& req)
+{
+    // Installation takes minutes, the call is waited without timeout
+    constexpr uint64_t noTimeout = UINT64_MAX;
+
+    BusLock busLock(systemBusMutex);
+
+    namespace rules = sdbusplus::bus::match::rules;
+    sdbusplus::bus::match_t progress(
+        systemBus,
+        rules::type::signal() + rules::sender(DAEMON_BUSNAME) +
+            rules::path(DAEMON_PATH) + rules::interface(DAEMON_INTERFACE) +
+            rules::member("Progress"),
+        [](sdbusplus::message::message& msg) {
+            std::string title, state;
+            msg.read(title, state);
+            printProgress(title, state);
+        });
+
+    std::vector<sdbusplus::message::message> requests{req};
+    std::optional<sdbusplus::message::message> reply;
+    callBatch(
+        requests,
+        [&reply](size_t, sdbusplus::message::message& msg) {
+            reply.emplace(msg);
+        },
+        noTimeout);
+
+    if (!reply)
+    {
+        throw FwupdateError("No reply from the firmware updater service");
+    }
+    if (reply->is_method_error())
+    {
+        const sd_bus_error* err = sd_bus_message_get_error(reply->get());
+        throw FwupdateError("%s", err && err->message ? err->message
+                                                      : "Unknown error");
+    }
+
+    return *reply;
+}
@@ -0,0 +1,62 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "dbus.hpp"
+
+#include <utility>
+
+/**
+ * @brief Run the firmware updater as a D-Bus service.
+ *        The service keeps the updaters, caches and the bus connection
+ *        between the requests, the files of the package are removed once
+ *        it is installed or rejected. Never returns.
+ *
+ * @throw FwupdateError in case of errors
+ */
+[[noreturn]] void runDaemon();
+
+/**
+ * @brief Check if the firmware updater service is running.
+ *
+ * @return true if the service bus name has an owner
+ */
+bool isDaemonRunning();
+
+/**
+ * @brief Call method of the firmware updater service.
+ *        The progress of the service tasks is printed while waiting for
+ *        the reply.
+ *
+ * @param req - method call
+ *
+ * @return Reply message
+ *
+ * @throw FwupdateError if the call failed
+ */
+sdbusplus::message::message callDaemonMethod(sdbusplus::message::message& req);
+
+/**
+ * @brief Call method of the firmware updater service.
+ *
+ * @param method - method name
+ * @param args   - method arguments
+ *
+ * @return Reply message
+ *
+ * @throw FwupdateError if the call failed
+ */
+template <typename... Args>
+sdbusplus::message::message callDaemon(const char* method, Args&&... args)
+{
+    BusLock busLock(systemBusMutex);
+    auto req = systemBus.new_method_call(DAEMON_BUSNAME, DAEMON_PATH,
+                                         DAEMON_INTERFACE, method);
+    req.append(std::forward<Args>(args)...);
+    return callDaemonMethod(req);
+}
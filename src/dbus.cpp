@@ -8,11 +8,90 @@
 #include "dbus.hpp"
 
 #include <sdbusplus/bus/match.hpp>
+#include <systemd/sd-bus.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <set>
 
 sdbusplus::bus::bus systemBus = sdbusplus::bus::new_default();
+std::recursive_mutex systemBusMutex;
+
+/**
+ * @brief Context of the asynchronous call from the batch.
+ */
+struct BatchCall
+{
+    size_t index;    //! Index of the request in the batch
+    size_t* pending; //! Number of the calls without reply
+    const std::function<void(size_t, sdbusplus::message::message&)>* handler;
+};
+
+/**
+ * @brief Handle reply of the asynchronous call from the batch.
+ */
+static int batchReply(sd_bus_message* msg, void* userdata, sd_bus_error*)
+{
+    auto call = static_cast<BatchCall*>(userdata);
+    --*call->pending;
+
+    sdbusplus::message::message reply(msg);
+    try
+    {
+        (*call->handler)(call->index, reply);
+    }
+    catch (const std::exception&)
+    {
+        // Unexpected reply is handled as a failed call
+    }
+
+    return 0;
+}
+
+void callBatch(
+    std::vector<sdbusplus::message::message>& requests,
+    const std::function<void(size_t, sdbusplus::message::message&)>& handler,
+    uint64_t timeout)
+{
+    using Slot = std::unique_ptr<sd_bus_slot, decltype(&sd_bus_slot_unref)>;
+
+    BusLock busLock(systemBusMutex);
+
+    size_t pending = 0;
+    std::vector<BatchCall> calls(requests.size());
+    std::vector<Slot> slots;
+    slots.reserve(requests.size());
+
+    for (size_t i = 0; i < requests.size(); ++i)
+    {
+        calls[i] = {i, &pending, &handler};
+
+        sd_bus_slot* slot = nullptr;
+        const int rc = sd_bus_call_async(systemBus.get(), &slot,
+                                         requests[i].get(), batchReply,
+                                         &calls[i], timeout);
+        if (rc < 0)
+        {
+            throw FwupdateError("Async D-Bus call failed: %s", strerror(-rc));
+        }
+        slots.emplace_back(slot, &sd_bus_slot_unref);
+        ++pending;
+    }
+
+    while (pending)
+    {
+        systemBus.process_discard();
+        if (pending)
+        {
+            systemBus.wait();
+        }
+    }
+}
 
 Objects getObjects(const Path& path, const Interfaces& ifaces)
 {
+    BusLock busLock(systemBusMutex);
     auto mapper = systemBus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
                                             MAPPER_INTERFACE, "GetObject");
     mapper.append(path, ifaces);
@@ -30,6 +109,7 @@ Objects getObjects(const Path& path, const Interfaces& ifaces)
 
 ObjectsMap getSubTree(const Path& path, const Interfaces& ifaces, int32_t depth)
 {
+    BusLock busLock(systemBusMutex);
     auto mapper = systemBus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
                                             MAPPER_INTERFACE, "GetSubTree");
     mapper.append(path, depth, ifaces);
@@ -47,6 +127,7 @@ ObjectsMap getSubTree(const Path& path, const Interfaces& ifaces, int32_t depth)
 
 void startUnit(const std::string& unitname)
 {
+    BusLock busLock(systemBusMutex);
     auto req = systemBus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
                                          SYSTEMD_INTERFACE, "StartUnit");
     req.append(unitname, "replace");
@@ -55,6 +136,7 @@ void startUnit(const std::string& unitname)
 
 bool doesUnitExist(const std::string& unitname)
 {
+    BusLock busLock(systemBusMutex);
     auto req = systemBus.new_method_call(SYSTEMD_BUSNAME, SYSTEMD_PATH,
                                          SYSTEMD_INTERFACE, "GetUnit");
     req.append(unitname);
@@ -86,6 +168,7 @@ void unsubscribeFromSystemdSignals()
 
 void stopUnit(const std::string& unitname)
 {
+    BusLock busLock(systemBusMutex);
     if (doesUnitExist(unitname))
     {
         bool serviceStopped = false;
@@ -129,8 +212,97 @@ void stopUnit(const std::string& unitname)
     }
 }
 
+void stopUnits(const std::vector<std::string>& unitnames)
+{
+    BusLock busLock(systemBusMutex);
+
+    std::vector<sdbusplus::message::message> requests;
+    requests.reserve(unitnames.size());
+    for (const auto& unitname : unitnames)
+    {
+        requests.emplace_back(systemBus.new_method_call(
+            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "GetUnit"));
+        requests.back().append(unitname);
+    }
+
+    std::vector<std::string> units;
+    callBatch(requests,
+              [&](size_t index, sdbusplus::message::message& reply) {
+                  if (!reply.is_method_error())
+                  {
+                      units.push_back(unitnames[index]);
+                  }
+              });
+    if (units.empty())
+    {
+        return;
+    }
+
+    // The jobs may be removed before the replies to StopUnit are handled,
+    // so the signals are collected from the very beginning
+    std::set<std::string> removed;
+    sdbusplus::bus::match_t systemdSignals(
+        systemBus,
+        sdbusplus::bus::match::rules::type::signal() +
+            sdbusplus::bus::match::rules::member("JobRemoved") +
+            sdbusplus::bus::match::rules::path(SYSTEMD_PATH) +
+            sdbusplus::bus::match::rules::interface(SYSTEMD_INTERFACE),
+        [&](sdbusplus::message::message& msg) {
+            uint32_t jobID;
+            sdbusplus::message::object_path jobPath;
+            std::string jobUnit;
+            std::string jobResult;
+
+            msg.read(jobID, jobPath, jobUnit, jobResult);
+            removed.insert(jobPath.str);
+        });
+
+    subscribeToSystemdSignals();
+
+    requests.clear();
+    for (const auto& unitname : units)
+    {
+        requests.emplace_back(systemBus.new_method_call(
+            SYSTEMD_BUSNAME, SYSTEMD_PATH, SYSTEMD_INTERFACE, "StopUnit"));
+        requests.back().append(unitname, "replace");
+    }
+
+    std::vector<std::string> jobs;
+    std::string failed;
+    callBatch(requests,
+              [&](size_t index, sdbusplus::message::message& reply) {
+                  if (reply.is_method_error())
+                  {
+                      failed += failed.empty() ? "" : ", ";
+                      failed += units[index];
+                      return;
+                  }
+                  sdbusplus::message::object_path job;
+                  reply.read(job);
+                  jobs.emplace_back(job.str);
+              });
+
+    auto isRunning = [&](const auto& job) { return !removed.count(job); };
+    while (std::any_of(jobs.begin(), jobs.end(), isRunning))
+    {
+        systemBus.process_discard();
+        if (std::any_of(jobs.begin(), jobs.end(), isRunning))
+        {
+            systemBus.wait();
+        }
+    }
+
+    unsubscribeFromSystemdSignals();
+
+    if (!failed.empty())
+    {
+        throw FwupdateError("Unable to stop %s", failed.c_str());
+    }
+}
+
 bool isChassisOn()
 {
+    BusLock busLock(systemBusMutex);
     auto objs = getObjects(CHASSIS_STATE_PATH, {CHASSIS_STATE_IFACE});
     auto state =
         getProperty<std::string>(objs.begin()->first, CHASSIS_STATE_PATH,
@@ -11,6 +11,12 @@
 
 #include <sdbusplus/bus.hpp>
 
+#include <functional>
+#include <map>
+#include <mutex>
+#include <variant>
+#include <vector>
+
 using BusName = std::string;
 using Path = std::string;
 using Interface = std::string;
@@ -65,11 +71,29 @@ void startUnit(const std::string& unitname);
  */
 void stopUnit(const std::string& unitname);
 
+/**
+ * @brief Stop several systemd units at once.
+ *        All the stop jobs are queued together and then the completion of
+ *        each job is awaited, the units that don't exist are skipped.
+ *
+ * @param unitnames - Names of the systemd units.
+ *
+ * @throw FwupdateError if any of the units couldn't be stopped
+ */
+void stopUnits(const std::vector<std::string>& unitnames);
+
 /**
  * @brief Bus handler singleton
  */
 extern sdbusplus::bus::bus systemBus;
 
+/**
+ * @brief Guard of the bus handler.
+ *        The bus connection must not be used by several threads at once.
+ */
+extern std::recursive_mutex systemBusMutex;
+using BusLock = std::lock_guard<std::recursive_mutex>;
+
 using PropertyName = std::string;
 
 /**
@@ -86,6 +110,7 @@ template <typename PropertyType>
 PropertyType getProperty(const BusName& busname, const Path& path,
                          const Interface& iface, const PropertyName& property)
 {
+    BusLock busLock(systemBusMutex);
     auto req = systemBus.new_method_call(busname.c_str(), path.c_str(),
                                          SYSTEMD_PROPERTIES_INTERFACE, "Get");
     req.append(iface, property);
@@ -117,6 +142,7 @@ void setProperty(const BusName& busname, const Path& path,
                  const Interface& iface, const PropertyName& property,
                  const PropertyType& value)
 {
+    BusLock busLock(systemBusMutex);
     auto req = systemBus.new_method_call(busname.c_str(), path.c_str(),
                                          SYSTEMD_PROPERTIES_INTERFACE, "Set");
     req.append(iface, property, std::variant<PropertyType>(value));
@@ -131,6 +157,76 @@ void setProperty(const BusName& busname, const Path& path,
     }
 }
 
+/**
+ * @brief Perform several method calls at once.
+ *        All requests are sent without waiting for replies, so the whole
+ *        batch costs a single round trip instead of one per call.
+ *
+ * @param requests - method calls to perform
+ * @param handler  - function to handle the reply (or the error), it gets
+ *                   the index of the request and the reply message
+ * @param timeout  - max time to wait for each reply in microseconds,
+ *                   0 to use the default D-Bus timeout
+ *
+ * @throw FwupdateError if the request can't be sent
+ */
+void callBatch(
+    std::vector<sdbusplus::message::message>& requests,
+    const std::function<void(size_t, sdbusplus::message::message&)>& handler,
+    uint64_t timeout = 0);
+
+/**
+ * @brief Target of the GetAll properties request.
+ */
+struct PropertiesQuery
+{
+    BusName busname; //! D-Bus service name
+    Path path;       //! Object path
+    Interface iface; //! Properties interface
+};
+
+template <typename PropertyType>
+using PropertiesMap = std::map<PropertyName, PropertyType>;
+
+/**
+ * @brief Get all D-Bus properties of several objects in a single batch.
+ *        The properties with types that don't match PropertyType are
+ *        skipped.
+ *
+ * @param queries - list of objects and interfaces
+ *
+ * @return Map of property names and values for each query, the map is empty
+ *         if the call failed
+ *
+ * @throw FwupdateError if the request can't be sent
+ */
+template <typename PropertyType>
+std::vector<PropertiesMap<PropertyType>>
+    getAllProperties(const std::vector<PropertiesQuery>& queries)
+{
+    BusLock busLock(systemBusMutex);
+    std::vector<sdbusplus::message::message> requests;
+    requests.reserve(queries.size());
+    for (const auto& query : queries)
+    {
+        requests.emplace_back(systemBus.new_method_call(
+            query.busname.c_str(), query.path.c_str(),
+            SYSTEMD_PROPERTIES_INTERFACE, "GetAll"));
+        requests.back().append(query.iface);
+    }
+
+    std::vector<PropertiesMap<PropertyType>> properties(queries.size());
+    callBatch(requests,
+              [&properties](size_t index, sdbusplus::message::message& reply) {
+                  if (!reply.is_method_error())
+                  {
+                      reply.read(properties[index]);
+                  }
+              });
+
+    return properties;
+}
+
 /**
  * @brief Check whether the host is running
  *
@@ -0,0 +1,525 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "flash.hpp"
+
+#include "fwupderr.hpp"
+#include "signature.hpp"
+#include "tracer.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Preferred size of a single write operation
+static constexpr size_t writeChunkSize = 1024 * 1024;
+// Value of the erased flash byte
+static constexpr uint8_t erasedByte = 0xff;
+// Hash function of the verification digests
+static constexpr auto verifyHashFunc = "sha256";
+// Each n-th erase block is checked in the sample verification mode
+static constexpr size_t sampleInterval = 16;
+
+FlashVerify getFlashVerify(const std::string& name)
+{
+    if (name == "readback")
+    {
+        return FlashVerify::readback;
+    }
+    if (name == "digest")
+    {
+        return FlashVerify::digest;
+    }
+    if (name == "sample")
+    {
+        return FlashVerify::sample;
+    }
+    throw FwupdateError("Unknown flash verification mode: %s", name.c_str());
+}
+
+/**
+ * @brief Check if memory is filled by specified byte.
+ *        Data is scanned by words in blocks without early exit inside the
+ *        block, so the inner loop is vectorized by the compiler.
+ */
+static bool isFilled(const uint8_t* data, size_t size, uint8_t value)
+{
+    constexpr size_t scanBlock = 256;
+    const uint64_t pattern = 0x0101010101010101ull * value;
+
+    size_t pos = 0;
+    for (; pos + scanBlock <= size; pos += scanBlock)
+    {
+        uint64_t diff = 0;
+        for (size_t i = 0; i < scanBlock; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, data + pos + i, sizeof(word));
+            diff |= word ^ pattern;
+        }
+        if (diff)
+        {
+            return false;
+        }
+    }
+    for (; pos < size; ++pos)
+    {
+        if (data[pos] != value)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Verification of the written data by the digests.
+ *        Digests of the image erase blocks are calculated while the image
+ *        is written, the readback of the blocks is hashed and compared by
+ *        the background thread, so the check overlaps with programming of
+ *        the next chunks.
+ */
+class BlockVerifier
+{
+  public:
+    BlockVerifier(const BlockVerifier&) = delete;
+    BlockVerifier& operator=(const BlockVerifier&) = delete;
+
+    /**
+     * @brief Constructor: start the background thread.
+     *
+     * @param flash  - flash drive
+     * @param sample - flag to check only sampled erase blocks
+     */
+    BlockVerifier(FlashIFace& flash, bool sample) :
+        flash(flash), sample(sample), image(verifyHashFunc),
+        worker(&BlockVerifier::run, this)
+    {}
+
+    ~BlockVerifier()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            jobs.clear();
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    /**
+     * @brief Hash the next portion of the image for the check of the whole
+     *        written range.
+     */
+    void update(const uint8_t* data, size_t length)
+    {
+        if (sample)
+        {
+            image.update(data, length);
+        }
+    }
+
+    /**
+     * @brief Schedule the check of the programmed range.
+     *
+     * @param offset - offset of the range, aligned to the erase block
+     * @param data   - data written to the range
+     * @param length - size of the range
+     *
+     * @throw FwupdateError if any previous check failed
+     */
+    void submit(size_t offset, const uint8_t* data, size_t length)
+    {
+        const size_t eraseSize = flash.eraseSize();
+        std::deque<Job> blocks;
+        for (size_t pos = 0; pos < length; pos += eraseSize)
+        {
+            if (sample && ((offset + pos) / eraseSize) % sampleInterval)
+            {
+                continue;
+            }
+            const size_t blockLen = std::min(eraseSize, length - pos);
+            Digest digest(verifyHashFunc);
+            digest.update(data + pos, blockLen);
+            blocks.push_back({offset + pos, blockLen, digest.final()});
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            std::move(blocks.begin(), blocks.end(), std::back_inserter(jobs));
+        }
+        cv.notify_one();
+    }
+
+    /**
+     * @brief Get the end of the checked data.
+     *
+     * @param end - end of the submitted data
+     *
+     * @return Offset of the first block which is not checked yet or failed
+     *         the check
+     */
+    size_t checked(size_t end)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error)
+        {
+            // The blocks are checked in order, the preceding ones are fine
+            return std::min(end, current);
+        }
+        if (busy)
+        {
+            return std::min(end, current);
+        }
+        return jobs.empty() ? end : std::min(end, jobs.front().offset);
+    }
+
+    /**
+     * @brief Wait for the scheduled checks. In the sample mode the whole
+     *        written range is read back and its digest is compared with the
+     *        image digest.
+     *
+     * @param offset - offset of the written range
+     * @param size   - size of the written range
+     *
+     * @throw FwupdateError in case of verification failure
+     */
+    void finish(size_t offset, size_t size)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock,
+                      [this]() { return error || (!busy && jobs.empty()); });
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+
+        if (sample)
+        {
+            Digest digest(verifyHashFunc);
+            std::vector<uint8_t> buf(writeChunkSize);
+            for (size_t pos = 0; pos < size; pos += buf.size())
+            {
+                const size_t len = std::min(buf.size(), size - pos);
+                flash.read(offset + pos, buf.data(), len);
+                digest.update(buf.data(), len);
+            }
+            if (digest.final() != image.final())
+            {
+                throw FwupdateError("Flash verification failed in range "
+                                    "0x%zx+0x%zx",
+                                    offset, size);
+            }
+        }
+    }
+
+  private:
+    /**
+     * @brief Check of the erase block.
+     */
+    struct Job
+    {
+        size_t offset;      //! Offset of the block
+        size_t length;      //! Size of the written data
+        DigestValue digest; //! Digest of the written data
+    };
+
+    /**
+     * @brief Background thread routine.
+     */
+    void run()
+    {
+        std::vector<uint8_t> buf;
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                busy = false;
+                if (jobs.empty())
+                {
+                    idle.notify_all();
+                }
+                cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+                if (stop)
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+                busy = true;
+                current = job.offset;
+            }
+
+            try
+            {
+                buf.resize(job.length);
+                flash.read(job.offset, buf.data(), job.length);
+                Digest digest(verifyHashFunc);
+                digest.update(buf.data(), buf.size());
+                if (digest.final() != job.digest)
+                {
+                    throw FwupdateError(
+                        "Flash verification failed at offset 0x%zx",
+                        job.offset);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = std::current_exception();
+                jobs.clear();
+            }
+        }
+    }
+
+    FlashIFace& flash; //! Flash drive
+    bool sample;       //! Check only sampled blocks
+    Digest image;      //! Digest of the whole image, sample mode only
+
+    std::deque<Job> jobs;         //! Scheduled checks
+    std::mutex mutex;             //! Queue guard
+    std::condition_variable cv;   //! Queue notification
+    std::condition_variable idle; //! Notification of the empty queue
+    bool busy = false;            //! The check is in progress
+    size_t current = 0;           //! Offset of the block being checked/failed
+    bool stop = false;            //! Flag to stop the thread
+    std::exception_ptr error;     //! First failure
+    std::thread worker;           //! Background thread, started last
+};
+
+/**
+ * @brief Erase, write and verify the range of the flash drive.
+ *
+ * @param flash    - flash drive
+ * @param offset   - offset of the range, aligned to the erase block
+ * @param data     - data to write
+ * @param length   - size of data
+ * @param readback - buffer for the verification, at least `length` bytes
+ * @param verifier - background verifier, nullptr to verify the readback
+ */
+static void program(FlashIFace& flash, size_t offset, const uint8_t* data,
+                    size_t length, uint8_t* readback, BlockVerifier* verifier)
+{
+    const size_t eraseSize = flash.eraseSize();
+    // Round the erased range up to the erase block
+    const size_t eraseLength =
+        std::min((length + eraseSize - 1) / eraseSize * eraseSize,
+                 flash.size() - offset);
+
+    flash.erase(offset, eraseLength);
+
+    // Erased blocks of the image need no programming, only sequences of
+    // the blocks with data are written.
+    size_t pos = 0;
+    while (pos < length)
+    {
+        const size_t blockLen = std::min(eraseSize, length - pos);
+        if (isFilled(data + pos, blockLen, erasedByte))
+        {
+            pos += blockLen;
+            continue;
+        }
+
+        size_t end = pos + blockLen;
+        while (end < length)
+        {
+            const size_t len = std::min(eraseSize, length - end);
+            if (isFilled(data + end, len, erasedByte))
+            {
+                break;
+            }
+            end += len;
+        }
+
+        flash.write(offset + pos, data + pos, end - pos);
+        pos = end;
+    }
+
+    // The skipped blocks are verified to be erased by the same comparison
+    if (verifier)
+    {
+        verifier->submit(offset, data, length);
+        return;
+    }
+    flash.read(offset, readback, length);
+    if (memcmp(readback, data, length) != 0)
+    {
+        throw FwupdateError("Flash verification failed at offset 0x%zx",
+                            offset);
+    }
+}
+
+void writeFlash(FlashIFace& flash, size_t offset, const uint8_t* data,
+                size_t size, const FlashOptions& options, Tracer& tracer,
+                FlashJournal* journal)
+{
+    if (offset > flash.size() || size > flash.size() - offset)
+    {
+        throw FwupdateError("The image doesn't fit the flash drive "
+                            "(0x%zx+0x%zx > 0x%zx)",
+                            offset, size, flash.size());
+    }
+
+    const size_t eraseSize = flash.eraseSize();
+    if (offset % eraseSize)
+    {
+        throw FwupdateError("Unaligned flash write at offset 0x%zx", offset);
+    }
+
+    const size_t chunkSize =
+        std::max(eraseSize, writeChunkSize / eraseSize * eraseSize);
+    std::vector<uint8_t> readback(chunkSize);
+
+    // Resume the interrupted write if the last written block is intact
+    size_t start = 0;
+    if (journal)
+    {
+        start = std::min(journal->written(), size) / eraseSize * eraseSize;
+        if (start)
+        {
+            const size_t block = start - eraseSize;
+            flash.read(offset + block, readback.data(), eraseSize);
+            if (memcmp(readback.data(), data + block, eraseSize) != 0)
+            {
+                start = 0;
+            }
+        }
+    }
+
+    std::optional<BlockVerifier> verifier;
+    if (options.verify != FlashVerify::readback)
+    {
+        verifier.emplace(flash, options.verify == FlashVerify::sample);
+        // The whole range digest covers the data written before
+        verifier->update(data, start);
+    }
+
+    // Report the written chunk and save the progress of the checked data
+    auto chunkDone = [&](size_t pos, size_t length) {
+        tracer.addBytes(length);
+        tracer.progress(pos + length, size);
+        if (journal && options.verify != FlashVerify::sample)
+        {
+            const size_t end = offset + pos + length;
+            journal->commit((verifier ? verifier->checked(end) : end) -
+                            offset);
+        }
+    };
+
+    for (size_t pos = start; pos < size; pos += chunkSize)
+    {
+        const size_t length = std::min(chunkSize, size - pos);
+        const size_t flashPos = offset + pos;
+
+        if (verifier)
+        {
+            verifier->update(data + pos, length);
+        }
+
+        if (!options.incremental)
+        {
+            program(flash, flashPos, data + pos, length, readback.data(),
+                    verifier ? &*verifier : nullptr);
+            chunkDone(pos, length);
+            continue;
+        }
+
+        // Read the whole erase blocks: the tail of the last block beyond
+        // the image is expected to be erased.
+        const size_t blocksLength =
+            std::min((length + eraseSize - 1) / eraseSize * eraseSize,
+                     flash.size() - flashPos);
+        flash.read(flashPos, readback.data(), blocksLength);
+
+        // Rewrite sequences of changed blocks
+        size_t changed = 0; // Start of the changed sequence
+        bool inChanged = false;
+        for (size_t block = 0; block <= blocksLength; block += eraseSize)
+        {
+            bool same = block == blocksLength; // Flush the last sequence
+            if (!same)
+            {
+                const size_t dataLen = std::min(eraseSize, length - block);
+                const uint8_t* current = readback.data() + block;
+                same = memcmp(current, data + pos + block, dataLen) == 0 &&
+                       isFilled(current + dataLen,
+                                std::min(eraseSize, blocksLength - block) -
+                                    dataLen,
+                                erasedByte);
+            }
+
+            if (!same && !inChanged)
+            {
+                changed = block;
+                inChanged = true;
+            }
+            else if (same && inChanged)
+            {
+                const size_t end = std::min(block, length);
+                program(flash, flashPos + changed, data + pos + changed,
+                        end - changed, readback.data() + changed,
+                        verifier ? &*verifier : nullptr);
+                inChanged = false;
+            }
+        }
+
+        chunkDone(pos, length);
+    }
+
+    if (verifier)
+    {
+        verifier->finish(offset, size);
+    }
+    if (journal)
+    {
+        journal->commit(size);
+    }
+}
+
+void writeRegion(FlashIFace& flash, size_t offset, const uint8_t* data,
+                 size_t size, const FlashOptions& options, Tracer& tracer)
+{
+    if (offset > flash.size() || size > flash.size() - offset)
+    {
+        throw FwupdateError("The region doesn't fit the flash drive "
+                            "(0x%zx+0x%zx > 0x%zx)",
+                            offset, size, flash.size());
+    }
+
+    const size_t eraseSize = flash.eraseSize();
+    const size_t start = offset / eraseSize * eraseSize;
+    const size_t end = std::min(
+        (offset + size + eraseSize - 1) / eraseSize * eraseSize, flash.size());
+
+    if (start == offset && end == offset + size)
+    {
+        // Already aligned
+        writeFlash(flash, offset, data, size, options, tracer);
+        return;
+    }
+
+    // Merge the region with the current content of edge blocks
+    std::vector<uint8_t> blocks(end - start);
+    flash.read(start, blocks.data(), offset - start);
+    flash.read(offset + size, blocks.data() + (offset + size - start),
+               end - offset - size);
+    std::copy(data, data + size, blocks.begin() + (offset - start));
+
+    writeFlash(flash, start, blocks.data(), blocks.size(), options, tracer);
+}
@@ -0,0 +1,157 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct Tracer;
+
+/**
+ * @brief Flash drive interface.
+ */
+struct FlashIFace
+{
+    virtual ~FlashIFace() = default;
+
+    /**
+     * @brief Get size of the flash drive in bytes.
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * @brief Get size of the erase block in bytes.
+     */
+    virtual size_t eraseSize() const = 0;
+
+    /**
+     * @brief Erase specified range, must be aligned to the erase block.
+     *
+     * @param offset - offset of the range
+     * @param length - size of the range
+     *
+     * @throw FwupdateError in case of errors
+     */
+    virtual void erase(size_t offset, size_t length) = 0;
+
+    /**
+     * @brief Write data at specified offset.
+     *
+     * @param offset - offset on the flash drive
+     * @param data   - data to write
+     * @param length - size of data
+     *
+     * @throw FwupdateError in case of errors
+     */
+    virtual void write(size_t offset, const void* data, size_t length) = 0;
+
+    /**
+     * @brief Read data from specified offset.
+     *
+     * @param offset - offset on the flash drive
+     * @param data   - destination buffer
+     * @param length - number of bytes to read
+     *
+     * @throw FwupdateError in case of errors
+     */
+    virtual void read(size_t offset, void* data, size_t length) = 0;
+};
+
+/**
+ * @brief Verification of the written data.
+ */
+enum class FlashVerify
+{
+    readback, //! Compare the readback of each chunk with the image
+    digest,   //! Compare digests of all erase blocks in background
+    sample,   //! Compare digests of sampled erase blocks in background and
+              //! the digest of the whole written range at the end
+};
+
+/**
+ * @brief Get the verification mode by its name.
+ *
+ * @param name - mode name: readback, digest or sample
+ *
+ * @return Verification mode
+ *
+ * @throw FwupdateError in case of unknown name
+ */
+FlashVerify getFlashVerify(const std::string& name);
+
+/**
+ * @brief Flash write options.
+ */
+struct FlashOptions
+{
+    bool incremental = false; //! Skip erase blocks with the same content
+    FlashVerify verify = FlashVerify::readback; //! Verification mode
+};
+
+/**
+ * @brief Progress journal of the flash write.
+ */
+struct FlashJournal
+{
+    virtual ~FlashJournal() = default;
+
+    /**
+     * @brief Get size of the data written and verified before interruption.
+     */
+    virtual size_t written() const = 0;
+
+    /**
+     * @brief Save size of the data written and verified.
+     *
+     * @param size - size of the data from the start of the image
+     */
+    virtual void commit(size_t size) = 0;
+};
+
+/**
+ * @brief Write the image to the flash drive.
+ *        The image is written by large chunks aligned to the erase block,
+ *        each chunk is erased, programmed and verified. In the digest modes
+ *        the verification runs in background while the next chunks are
+ *        programmed.
+ *        In the incremental mode the current content of the flash drive is
+ *        read first and only the erase blocks that differ are rewritten.
+ *        With the journal the interrupted write is resumed after the check
+ *        of the last written erase block, the progress is committed after
+ *        each chunk is verified. The sample verification checks the data
+ *        only at the end, so there is nothing to commit before.
+ *
+ * @param flash   - flash drive
+ * @param offset  - start offset on the flash drive, aligned to erase block
+ * @param data    - image data
+ * @param size    - size of the image
+ * @param options - write options
+ * @param tracer  - tracer to report progress
+ * @param journal - optional progress journal
+ *
+ * @throw FwupdateError in case of errors
+ */
+void writeFlash(FlashIFace& flash, size_t offset, const uint8_t* data,
+                size_t size, const FlashOptions& options, Tracer& tracer,
+                FlashJournal* journal = nullptr);
+
+/**
+ * @brief Write the region at arbitrary offset of the flash drive.
+ *        Partially covered erase blocks at the region edges are read and
+ *        their content outside the region is preserved.
+ *
+ * @param flash   - flash drive
+ * @param offset  - offset of the region
+ * @param data    - region data
+ * @param size    - size of the region
+ * @param options - write options
+ * @param tracer  - tracer to report progress
+ *
+ * @throw FwupdateError in case of errors
+ */
+void writeRegion(FlashIFace& flash, size_t offset, const uint8_t* data,
+                 size_t size, const FlashOptions& options, Tracer& tracer);
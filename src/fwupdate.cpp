@@ -9,8 +9,10 @@
 
 #include "dbus.hpp"
 #include "fwupderr.hpp"
+#include "parser.hpp"
 #include "signature.hpp"
 #include "subprocess.hpp"
+#include "tar.hpp"
 #include "tracer.hpp"
 
 #ifdef OBMC_PHOSPHOR_IMAGE
@@ -29,9 +31,17 @@
 #include "image_openpower.hpp"
 #endif
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
-#include <regex>
+#include <future>
+#include <map>
+#include <optional>
 
 /**
  * @brief Create temporary directory
@@ -49,48 +59,16 @@ static fs::path createTmpDir()
     return dir;
 }
 
-static const std::regex cfgLine("^\\s*([a-z0-9_]+)\\s*=\\s*\"?([^\"]+)\"?\\s*$",
-                                std::regex::icase);
-
 /**
- * @brief Get value of the key from specified config file
+ * @brief Create the updaters of all the supported firmware types.
  *
- * @param file - path to the config file
- * @param key  - the key name
+ * @param tmpdir - temporary directory of the package
  *
- * @return - value of the key
+ * @return Set of the updaters
  */
-static std::string getCfgValue(const fs::path& file, const std::string& key)
-{
-    std::string ret;
-    std::ifstream efile;
-    efile.exceptions(std::ifstream::failbit | std::ifstream::badbit |
-                     std::ifstream::eofbit);
-    try
-    {
-        std::string line;
-        std::smatch match;
-        efile.open(file);
-        while (std::getline(efile, line))
-        {
-            if (std::regex_match(line, match, cfgLine) && match[1].str() == key)
-            {
-                ret = match[2].str();
-                break;
-            }
-        }
-        efile.close();
-    }
-    catch (const std::ios_base::failure&)
-    {
-        efile.close();
-    }
-
-    return ret;
-}
-
-FwUpdate::FwUpdate(bool force) : tmpdir(createTmpDir()), force(force)
+static FwUpdate::Updaters createUpdaters(const fs::path& tmpdir)
 {
+    FwUpdate::Updaters updaters;
 #ifdef OPENPOWER_SUPPORT
     updaters.emplace_back(std::make_unique<OpenPowerUpdater>(tmpdir));
 #endif
@@ -102,18 +80,49 @@ FwUpdate::FwUpdate(bool force) : tmpdir(createTmpDir()), force(force)
 #endif
 #ifdef INTEL_PLATFORMS
     updaters.emplace_back(std::make_unique<IntelPlatformsUpdater>(tmpdir));
+#endif
+    return updaters;
+}
+
+FwUpdate::FwUpdate(bool force) : FwUpdate(force, createUpdaters)
+{
+}
+
+FwUpdate::FwUpdate(bool force, const UpdaterFactory& factory) :
+    tmpdir(createTmpDir()), force(force), updaters(factory(tmpdir))
+{
+#ifdef INTEL_C62X_SUPPORT
+    bios = nullptr;
+    for (const auto& updater : updaters)
+    {
+        if (auto biosUpdater = dynamic_cast<BIOSUpdater*>(updater.get()))
+        {
+            bios = biosUpdater;
+        }
+    }
 #endif
 }
 
 FwUpdate::~FwUpdate()
 {
-    unlock();
+    try
+    {
+        unlock();
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+    }
 
     updaters.clear();
 
     if (!tmpdir.empty())
     {
         std::error_code ec;
+        for (const auto& it : fs::directory_iterator(tmpdir, ec))
+        {
+            dropDigest(it.path());
+        }
         fs::remove_all(tmpdir, ec);
         tmpdir.clear();
     }
@@ -124,10 +133,13 @@ void FwUpdate::lock()
     if (!force)
     {
 #ifdef REBOOT_GUARD_SUPPORT
-        Tracer tracer("Locking BMC reboot");
-        startUnit(REBOOT_GUARD_ENABLE);
-        locked = true;
-        tracer.done();
+        if (!locked)
+        {
+            Tracer tracer("Locking BMC reboot");
+            startUnit(REBOOT_GUARD_ENABLE);
+            locked = true;
+            tracer.done();
+        }
 #endif
 
         for (auto it = updaters.rbegin(); it != updaters.rend(); ++it)
@@ -155,6 +167,30 @@ void FwUpdate::unlock()
 #endif
 }
 
+void FwUpdate::release()
+{
+    if (!batch)
+    {
+        unlock();
+    }
+}
+
+void FwUpdate::setForce(bool force)
+{
+    this->force = force;
+}
+
+void FwUpdate::beginBatch()
+{
+    batch = true;
+}
+
+void FwUpdate::endBatch()
+{
+    batch = false;
+    unlock();
+}
+
 void FwUpdate::reset()
 {
     lock();
@@ -162,7 +198,72 @@ void FwUpdate::reset()
     {
         updater->reset();
     }
-    unlock();
+    release();
+}
+
+#ifdef INTEL_C62X_SUPPORT
+std::vector<uint8_t> FwUpdate::readNvram()
+{
+    auto data = bios->readNvram();
+    release();
+    return data;
+}
+
+void FwUpdate::readNvram(const std::string& file)
+{
+    saveNvram(file, readNvram());
+}
+
+void FwUpdate::saveNvram(const std::string& file,
+                         const std::vector<uint8_t>& data)
+{
+    std::ofstream out;
+    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    try
+    {
+        out.open(file, std::ofstream::binary | std::ofstream::trunc);
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        out.close();
+    }
+    catch (const std::exception& e)
+    {
+        throw FwupdateError("Unable to write %s! %s", file.c_str(), e.what());
+    }
+}
+
+void FwUpdate::writeNvram(const std::string& file)
+{
+    bios->writeNvram(file);
+    release();
+}
+
+void FwUpdate::resetHostMacAddrs()
+{
+    bios->resetHostMacAddrs();
+    release();
+}
+#endif // INTEL_C62X_SUPPORT
+
+void FwUpdate::clearPackage()
+{
+    for (auto& updater : updaters)
+    {
+        updater->clear();
+    }
+    for (const auto& it : fs::directory_iterator(tmpdir))
+    {
+        dropDigest(it.path());
+        fs::remove_all(it.path());
+    }
+
+    pendingVerify = false;
+    index.reset();
+    systemKey.clear();
+    manifest.reset();
+    if (!batch)
+    {
+        systemKeys.reset();
+    }
 }
 
 bool FwUpdate::addFile(const fs::path& file)
@@ -183,24 +284,226 @@ bool FwUpdate::addFile(const fs::path& file)
     return ret;
 }
 
+bool FwUpdate::isFileRequired(const fs::path& file) const
+{
+    if (file == MANIFEST_FILE_NAME || file == PUBLICKEY_FILE_NAME)
+    {
+        return true;
+    }
+
+    // The signature is required only for the required file
+    const fs::path image = file.extension() == SIGNATURE_FILE_EXT
+                               ? file.parent_path() / file.stem()
+                               : file;
+    if (image == MANIFEST_FILE_NAME || image == PUBLICKEY_FILE_NAME)
+    {
+        return true;
+    }
+
+    for (const auto& updater : updaters)
+    {
+        if (updater->isFileFlashable(image))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Write the current member of archive to the file.
+ *
+ * @param tar    - archive reader
+ * @param file   - path to the destination file
+ * @param digest - optional digest context to update with the member data
+ */
+static void extractMember(TarReader& tar, const fs::path& file,
+                          std::optional<Digest>& digest)
+{
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        throw FwupdateError("open %s failed, error=%d: %s", file.c_str(), errno,
+                            strerror(errno));
+    }
+
+    try
+    {
+        std::array<uint8_t, 256 * 1024> buf;
+        size_t len;
+        while ((len = tar.read(buf.data(), buf.size())) != 0)
+        {
+            if (digest)
+            {
+                digest->update(buf.data(), len);
+            }
+
+            size_t done = 0;
+            while (done < len)
+            {
+                ssize_t rc = write(fd, buf.data() + done, len - done);
+                if (rc < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throw FwupdateError("write %s failed, error=%d: %s",
+                                        file.c_str(), errno, strerror(errno));
+                }
+                done += static_cast<size_t>(rc);
+            }
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+/**
+ * @brief Get the decompressor for the compressed package.
+ *
+ * @param fd - descriptor of the package, the file offset is not changed
+ *
+ * @return Command line tool, nullptr if the package is not compressed
+ */
+static const char* getDecompressor(int fd)
+{
+    struct Format
+    {
+        std::array<uint8_t, 6> magic;
+        size_t size;
+        const char* cmd;
+    };
+    static const std::array<Format, 3> formats = {{
+        {{0x28, 0xb5, 0x2f, 0xfd}, 4, ZSTD_CMD},
+        {{0xfd, '7', 'z', 'X', 'Z', 0x00}, 6, XZ_CMD},
+        {{0x1f, 0x8b}, 2, GZIP_CMD},
+    }};
+
+    std::array<uint8_t, 6> header{};
+    if (pread(fd, header.data(), header.size(), 0) == -1)
+    {
+        return nullptr;
+    }
+
+    for (const auto& format : formats)
+    {
+        if (std::equal(format.magic.begin(),
+                       format.magic.begin() + format.size, header.begin()))
+        {
+            return format.cmd;
+        }
+    }
+    return nullptr;
+}
+
 void FwUpdate::unpack(const fs::path& path)
 {
+    clearPackage();
+
     if (!addFile(path))
     {
         Tracer tracer("Unpack firmware package");
 
-        std::ignore =
-            exec(TAR_CMD " -xf %s -C %s 2>&1", path.c_str(), tmpdir.c_str());
+        // The bundle which is not changed since the last verification
+        // doesn't need the digests. The bundle is read only through the
+        // descriptor of the index, so the data matches the identity.
+        index.emplace(path);
+        const int fd = index->fd();
+        tracer.addBytes(index->size());
 
-        for (const auto& it : fs::directory_iterator(tmpdir))
+        if (TarReader::isTar(fd))
+        {
+            TarReader tar(fd);
+            extract(tar);
+        }
+        else if (auto decompressor = getDecompressor(fd))
+        {
+            // Compressed package is decompressed on the fly, only the
+            // required members are written to the temporary directory.
+            // The rest of the stream after the archive end is discarded
+            Subprocess proc({decompressor, "-dc"}, [](const char*, size_t) {},
+                            fd);
+            TarReader tar(proc.fd());
+            extract(tar);
+            checkWaitStatus(proc.wait(), std::string());
+        }
+        else
         {
-            addFile(it.path());
+            // Unknown format, let the external tool deal with it.
+            Subprocess proc({TAR_CMD, "-xf", "-", "-C", tmpdir}, nullptr, fd);
+            const int rc = proc.wait();
+            checkWaitStatus(rc, proc.takeOutput());
+
+            for (const auto& it : fs::directory_iterator(tmpdir))
+            {
+                addFile(it.path());
+            }
         }
 
         tracer.done();
     }
 }
 
+void FwUpdate::extract(TarReader& tar)
+{
+    // Single pass extraction: the members which are not used by any
+    // updater are skipped, images are hashed while they are written
+    // so the signature check doesn't read them again.
+    TarReader::Member member;
+    std::string hashFunc;
+    while (tar.next(member))
+    {
+        if (!member.isFile() || member.name.find('/') != std::string::npos ||
+            member.name == ".." || !isFileRequired(member.name))
+        {
+            continue;
+        }
+
+        const fs::path file = tmpdir / member.name;
+        std::optional<Digest> digest;
+        if (!index->isTrusted() && !hashFunc.empty() &&
+            member.name != MANIFEST_FILE_NAME &&
+            member.name != PUBLICKEY_FILE_NAME &&
+            file.extension() != SIGNATURE_FILE_EXT)
+        {
+            try
+            {
+                digest.emplace(hashFunc);
+            }
+            catch (const FwupdateError&)
+            {
+                // Unknown hash, the signature check will report it.
+                hashFunc.clear();
+            }
+        }
+
+        // The digest left by the previous package must not be used for
+        // the member which is not hashed now.
+        dropDigest(file);
+        extractMember(tar, file, digest);
+
+        if (digest)
+        {
+            storeDigest(file, hashFunc, digest->final());
+        }
+        else if (member.name == MANIFEST_FILE_NAME)
+        {
+            // Typically MANIFEST is the first member of the package
+            manifest = Config::load(file);
+            hashFunc = manifest->get("HashType");
+        }
+
+        addFile(file);
+    }
+}
+
 fs::path FwUpdate::getFWFile(const std::string& filename)
 {
     fs::path ret(tmpdir / filename);
@@ -211,6 +514,31 @@ fs::path FwUpdate::getFWFile(const std::string& filename)
     return ret;
 }
 
+const Config& FwUpdate::getManifest()
+{
+    if (!manifest)
+    {
+        manifest = Config::load(getFWFile(MANIFEST_FILE_NAME));
+    }
+    return *manifest;
+}
+
+const std::vector<FwUpdate::SystemKey>& FwUpdate::getSystemKeys()
+{
+    if (!systemKeys)
+    {
+        std::vector<SystemKey> found;
+        for (const auto& p : fs::directory_iterator(SIGNED_IMAGE_CONF_PATH))
+        {
+            found.emplace_back(
+                p.path() / PUBLICKEY_FILE_NAME,
+                Config::load(p.path() / HASH_FILE_NAME).get("HashType"));
+        }
+        systemKeys = std::move(found);
+    }
+    return *systemKeys;
+}
+
 void FwUpdate::systemLevelVerify()
 {
     Tracer tracer("Check signature of firmware package");
@@ -225,11 +553,8 @@ void FwUpdate::systemLevelVerify()
         // function. For any internal failure during the key/hash pair specific
         // validation, should continue the validation with next available
         // key/hash pair.
-        for (const auto& p : fs::directory_iterator(SIGNED_IMAGE_CONF_PATH))
+        for (const auto& [publicKey, hashFunc] : getSystemKeys())
         {
-            auto publicKey(p.path() / PUBLICKEY_FILE_NAME);
-            auto hashFunc = getCfgValue(p.path() / HASH_FILE_NAME, "HashType");
-
             try
             {
                 valid = verifyFile(publicKey, hashFunc, manifestFile);
@@ -238,6 +563,7 @@ void FwUpdate::systemLevelVerify()
                     valid = verifyFile(publicKey, hashFunc, publicKeyFile);
                     if (valid)
                     {
+                        systemKey = publicKey;
                         break;
                     }
                 }
@@ -262,8 +588,8 @@ void FwUpdate::systemLevelVerify()
 
 void FwUpdate::checkMachineType()
 {
-    auto currentMachine =
-        getCfgValue(OS_RELEASE_FILE, "OPENBMC_TARGET_MACHINE");
+    const auto currentMachine =
+        Config::load(OS_RELEASE_FILE).get("OPENBMC_TARGET_MACHINE");
     if (currentMachine.empty())
     {
         // We are running on an old BMC version.
@@ -274,8 +600,7 @@ void FwUpdate::checkMachineType()
     {
         Tracer tracer("Check target machine type");
 
-        auto manifestFile = getFWFile(MANIFEST_FILE_NAME);
-        auto targetMachine = getCfgValue(manifestFile, "MachineName");
+        const auto& targetMachine = getManifest().get("MachineName");
         if (currentMachine != targetMachine)
         {
             throw FwupdateError(
@@ -289,33 +614,154 @@ void FwUpdate::checkMachineType()
     }
 }
 
-void FwUpdate::verify()
+void FwUpdate::storeIndex()
+{
+    if (index && !systemKey.empty())
+    {
+        index->store(tmpdir, systemKey);
+    }
+}
+
+void FwUpdate::verify(bool pipeline)
 {
+    if (index && index->isVerified(tmpdir))
+    {
+        Tracer tracer("Check index of verified firmware package");
+        tracer.done();
+        return;
+    }
+
+    publicKeyFile = getFWFile(PUBLICKEY_FILE_NAME);
+    hashFunc = getManifest().get("HashType");
+
+    // Images are checked in background while the package level signature is
+    // verified. The results are not used if the package is not trusted.
+    for (auto& updater : updaters)
+    {
+        updater->scheduleVerify(publicKeyFile, hashFunc);
+    }
+
     systemLevelVerify();
 
-    auto publicKeyFile = getFWFile(PUBLICKEY_FILE_NAME);
-    auto manifestFile = getFWFile(MANIFEST_FILE_NAME);
-    auto hashFunc = getCfgValue(manifestFile, "HashType");
+    if (pipeline)
+    {
+        // Results will be collected by install()
+        pendingVerify = true;
+        return;
+    }
 
     for (auto& updater : updaters)
     {
         updater->verify(publicKeyFile, hashFunc);
     }
+
+    storeIndex();
+}
+
+/**
+ * @brief Get name of the flash drive to prefix traces.
+ */
+static const char* resourceName(FlashResource resource)
+{
+    switch (resource)
+    {
+        case FlashResource::bmc:
+            return "BMC";
+        case FlashResource::host:
+            return "Host";
+    }
+    return "";
+}
+
+bool FwUpdate::install(bool reset, FwUpdIFace& updater)
+{
+    if (pendingVerify)
+    {
+        // Other images are still being checked in background
+        updater.verify(publicKeyFile, hashFunc);
+    }
+    return updater.install(reset);
 }
 
 bool FwUpdate::install(bool reset)
 {
     bool ret = false;
 
-    lock();
+    // Updaters are grouped by the flash drive they write. Groups are
+    // installed concurrently, updaters of a group one after another.
+    std::map<FlashResource, std::vector<FwUpdIFace*>> groups;
     for (auto& updater : updaters)
     {
-        if (updater->install(reset))
+        if (updater->hasFiles())
         {
-            ret = true;
+            groups[updater->flashResource()].push_back(updater.get());
         }
     }
-    unlock();
+
+    lock();
+    if (groups.size() <= 1)
+    {
+        for (auto& updater : updaters)
+        {
+            if (install(reset, *updater))
+            {
+                ret = true;
+            }
+        }
+    }
+    else
+    {
+        std::vector<std::future<bool>> results;
+        for (const auto& entry : groups)
+        {
+            results.emplace_back(std::async(
+                std::launch::async,
+                [this, reset, prefix = resourceName(entry.first),
+                 &group = entry.second]() {
+                    Tracer::setPrefix(prefix);
+                    bool reboot = false;
+                    for (auto updater : group)
+                    {
+                        if (install(reset, *updater))
+                        {
+                            reboot = true;
+                        }
+                    }
+                    return reboot;
+                }));
+        }
+
+        // Wait for all groups, even if some of them failed
+        std::exception_ptr error;
+        for (auto& result : results)
+        {
+            try
+            {
+                if (result.get())
+                {
+                    ret = true;
+                }
+            }
+            catch (...)
+            {
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+    if (pendingVerify)
+    {
+        // All images are checked by this moment
+        pendingVerify = false;
+        storeIndex();
+    }
+    release();
 
     return ret;
 }
@@ -5,11 +5,22 @@
 
 #pragma once
 
+#include "config.h"
+
+#include "bundleindex.hpp"
 #include "fwupdiface.hpp"
+#include "parser.hpp"
 
+#include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
+class TarReader;
+#ifdef INTEL_C62X_SUPPORT
+struct BIOSUpdater;
+#endif // INTEL_C62X_SUPPORT
+
 /**
  * @brief General firmware updater implementation.
  */
@@ -25,15 +36,63 @@ struct FwUpdate
      */
     FwUpdate(bool force);
 
-    ~FwUpdate();
+    /**
+     * @brief Set of the updaters.
+     */
+    using Updaters = std::vector<std::unique_ptr<FwUpdIFace>>;
+
+    /**
+     * @brief Function to create the updaters for the temporary directory of
+     *        the package.
+     */
+    using UpdaterFactory = std::function<Updaters(const fs::path& tmpdir)>;
+
+    /**
+     * @brief FwUpdate object constructor with the custom set of updaters,
+     *        e.g. the updaters of the emulated flash drives.
+     *
+     * @param force   - flag to skip locking
+     * @param factory - function to create the updaters
+     */
+    FwUpdate(bool force, const UpdaterFactory& factory);
+
+    virtual ~FwUpdate();
 
     /**
      * @brief Reset all settings to manufacture default.
      */
     void reset();
 
+    /**
+     * @brief Start the batch of operations: the guards enabled by the
+     *        operations are kept until endBatch() call, so the whole batch
+     *        pays for the lock/unlock cycle only once.
+     */
+    void beginBatch();
+
+    /**
+     * @brief Finish the batch of operations and disable all the guards.
+     */
+    void endBatch();
+
+    /**
+     * @brief Set the flag to skip locking for the next operations.
+     *
+     * @param force - flag to skip locking
+     */
+    void setForce(bool force);
+
+    /**
+     * @brief Drop the files of the previous package.
+     *        Outside of the batch the cached system keys are dropped too,
+     *        so the next package is checked with the current keys.
+     */
+    void clearPackage();
+
     /**
      * @brief Unpack bundle package.
+     *        The files of the previous package are dropped, so the packages
+     *        of the batch are installed one after another.
      *
      * @param package - path to the firmware package
      */
@@ -41,8 +100,12 @@ struct FwUpdate
 
     /**
      * @brief Verify signature of firmware package
+     *
+     * @param pipeline - flag to check only the package level signature and
+     *                   start the images check in background, each updater
+     *                   waits for its own images right before installation
      */
-    void verify();
+    void verify(bool pipeline = false);
 
     /**
      * @brief Compare system and package machine types.
@@ -57,6 +120,43 @@ struct FwUpdate
      */
     bool install(bool reset);
 
+#ifdef INTEL_C62X_SUPPORT
+    /**
+     * @brief Read NVRAM of the host flash.
+     *
+     * @return NVRAM dump
+     */
+    std::vector<uint8_t> readNvram();
+
+    /**
+     * @brief Read NVRAM of the host flash to the file.
+     *
+     * @param file - path to the output file
+     */
+    void readNvram(const std::string& file);
+
+    /**
+     * @brief Write the NVRAM dump to the file.
+     *
+     * @param file - path to the output file
+     * @param data - NVRAM dump
+     */
+    static void saveNvram(const std::string& file,
+                          const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Write NVRAM of the host flash from the file.
+     *
+     * @param file - path to the NVRAM dump
+     */
+    void writeNvram(const std::string& file);
+
+    /**
+     * @brief Replace host MAC addresses with values from FRU.
+     */
+    void resetHostMacAddrs();
+#endif // INTEL_C62X_SUPPORT
+
   protected:
     /**
      * @brief Enable guards for all firmware types
@@ -68,6 +168,20 @@ struct FwUpdate
      */
     void unlock();
 
+    /**
+     * @brief Install firmware by specified updater
+     *
+     * @param reset   - flag to skip restore of the settings
+     * @param updater - firmware updater
+     * @return True if reboot required
+     */
+    bool install(bool reset, FwUpdIFace& updater);
+
+    /**
+     * @brief Disable the guards unless the batch is running.
+     */
+    void release();
+
     /**
      * @brief Add specified file to updater implementations
      *
@@ -77,20 +191,74 @@ struct FwUpdate
      */
     bool addFile(const fs::path& file);
 
+    /**
+     * @brief Check if specified file of the package is used by any updater
+     *        or required for the signature verification.
+     *
+     * @param file - name of the package member
+     *
+     * @return True if the file should be unpacked
+     */
+    bool isFileRequired(const fs::path& file) const;
+
+    /**
+     * @brief Extract the required members of the package.
+     *
+     * @param tar - package reader
+     */
+    void extract(TarReader& tar);
+
     /**
      * @brief Create fs::path object and check existence
      */
     fs::path getFWFile(const std::string& filename);
 
+    /**
+     * @brief Get the MANIFEST of the package, the file is parsed once.
+     */
+    const Config& getManifest();
+
+    /**
+     * @brief Public key path and hash function pair.
+     */
+    using SystemKey = std::pair<fs::path, std::string>;
+
+    /**
+     * @brief Get the list of public keys and hash functions available on the
+     *        system. The list is loaded once per package or once per batch,
+     *        so the long running daemon picks up the key changes on the next
+     *        request.
+     */
+    virtual const std::vector<SystemKey>& getSystemKeys();
+
     /**
      * @brief Verify the MANIFEST and publickey file using available public keys
      *        and hash on the system.
      */
     void systemLevelVerify();
 
+    /**
+     * @brief Write the index of the verified bundle.
+     */
+    virtual void storeIndex();
+
   private:
     fs::path tmpdir;
     bool force;
-    std::vector<std::unique_ptr<FwUpdIFace>> updaters;
+    Updaters updaters;
     bool locked = false;
+    bool batch = false; //! Keep the guards between the operations
+#ifdef INTEL_C62X_SUPPORT
+    BIOSUpdater* bios; //! Updater of the host flash, owned by updaters
+#endif // INTEL_C62X_SUPPORT
+
+    // Deferred images check for the pipelined installation
+    bool pendingVerify = false;
+    fs::path publicKeyFile;
+    std::string hashFunc;
+
+    std::optional<BundleIndex> index; //! Index of the verified bundle
+    fs::path systemKey;               //! System key that verified the bundle
+    std::optional<Config> manifest;   //! MANIFEST of the package
+    std::optional<std::vector<SystemKey>> systemKeys; //! Keys of the system
 };
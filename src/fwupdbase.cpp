@@ -6,15 +6,26 @@
 #include "fwupdbase.hpp"
 
 #include "fwupderr.hpp"
+#include "journal.hpp"
+#include "mtd.hpp"
 #include "signature.hpp"
 #include "tracer.hpp"
 
 #include "dbus.hpp"
 
+#include <optional>
+
+FlashOptions FwUpdBase::flashOptions;
+
 FwUpdBase::FwUpdBase(const fs::path& tmpdir) : tmpdir(tmpdir)
 {
 }
 
+bool FwUpdBase::hasFiles() const
+{
+    return !files.empty();
+}
+
 bool FwUpdBase::add(const fs::path& file)
 {
     bool ret = fs::is_regular_file(file) && isFileFlashable(file);
@@ -25,12 +36,37 @@ bool FwUpdBase::add(const fs::path& file)
     return ret;
 }
 
+void FwUpdBase::clear()
+{
+    files.clear();
+    verification.clear();
+}
+
+void FwUpdBase::scheduleVerify(const fs::path& publicKey,
+                               const std::string& hashFunc)
+{
+    if (verification.empty())
+    {
+        auto& verifier = Verifier::instance();
+        for (const auto& file : files)
+        {
+            verification.emplace_back(
+                verifier.submit(publicKey, hashFunc, file));
+        }
+    }
+}
+
 void FwUpdBase::verify(const fs::path& publicKey, const std::string& hashFunc)
 {
-    for (const auto& file : files)
+    scheduleVerify(publicKey, hashFunc);
+
+    // Checks are running in parallel, but results are reported in order
+    for (size_t i = 0; i < files.size(); ++i)
     {
+        const auto& file = files[i];
         Tracer tracer("Check signature for %s", file.filename().c_str());
-        if (!verifyFile(publicKey, hashFunc, file))
+        tracer.addBytes(fs::file_size(file));
+        if (!verification[i].get())
         {
             throw FwupdateError("The %s signature verification failed!",
                                 file.filename().c_str());
@@ -57,6 +93,43 @@ bool FwUpdBase::install(bool reset)
     return doAfterInstall(reset);
 }
 
+std::unique_ptr<FlashIFace> FwUpdBase::openFlash(const fs::path& device)
+{
+    return std::make_unique<MtdDevice>(device);
+}
+
+void FwUpdBase::flashImage(const fs::path& file, const fs::path& device,
+                           const std::string& journalName)
+{
+    flashImage(file, MappedMem::open(file), device, journalName);
+}
+
+void FwUpdBase::flashImage(const fs::path& file, const MappedMem& image,
+                           const fs::path& device,
+                           const std::string& journalName)
+{
+    const auto data = static_cast<const uint8_t*>(image.get());
+    std::optional<WriteJournal> journal;
+    if (!journalName.empty())
+    {
+        journal.emplace(journalName, device, data, image.size());
+    }
+
+    Tracer tracer(journal && journal->written() ? "Resuming write of %s to %s"
+                                                : "Writing %s to %s",
+                  file.filename().c_str(), device.c_str());
+
+    auto flash = openFlash(device);
+    writeFlash(*flash, 0, data, image.size(), flashOptions, tracer,
+               journal ? &*journal : nullptr);
+    if (journal)
+    {
+        journal->complete();
+    }
+
+    tracer.done();
+}
+
 void FwUpdBase::updateDBusStoredVersion(const std::string& objectPath,
                                          const std::string& version)
 {
@@ -65,6 +138,7 @@ void FwUpdBase::updateDBusStoredVersion(const std::string& objectPath,
     constexpr const char* versionInterface = "xyz.openbmc_project.Software.Version";
     constexpr const char* versionProperty = "Version";
 
+    BusLock busLock(systemBusMutex);
     auto method = systemBus.new_method_call(settingsService, objectPath.c_str(),
                                             dbusPropertiesInterface, "Set");
     try
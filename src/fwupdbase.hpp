@@ -4,8 +4,12 @@
  */
 #pragma once
 
+#include "flash.hpp"
 #include "fwupdiface.hpp"
+#include "mappedmem.hpp"
+#include "verifier.hpp"
 
+#include <memory>
 #include <vector>
 
 using Files = std::vector<fs::path>;
@@ -22,17 +26,18 @@ struct FwUpdBase : public FwUpdIFace
      */
     FwUpdBase(const fs::path& tmpdir);
 
+    bool hasFiles() const override;
     bool add(const fs::path& file) override;
+    void clear() override;
+    void scheduleVerify(const fs::path& publicKey,
+                        const std::string& hashFunc) override;
     void verify(const fs::path& publicKey,
                 const std::string& hashFunc) override;
     bool install(bool reset) override;
 
-  protected:
-    /**
-     * @brief Check if specified file can be flashed by this updater instance.
-     */
-    virtual bool isFileFlashable(const fs::path& file) const = 0;
+    static FlashOptions flashOptions; //! Options of the native flash writer
 
+  protected:
     /**
      * @brief Will be called before installation procedure
      *
@@ -65,6 +70,40 @@ struct FwUpdBase : public FwUpdIFace
      */
     void updateDBusStoredVersion(const std::string&, const std::string&);
 
+    /**
+     * @brief Open the flash drive.
+     *
+     * @param device - path to the MTD device
+     *
+     * @return Flash drive object
+     */
+    virtual std::unique_ptr<FlashIFace> openFlash(const fs::path& device);
+
+    /**
+     * @brief Write the firmware image to the flash drive.
+     *
+     * @param file        - path to the firmware image
+     * @param device      - path to the MTD device
+     * @param journalName - name of the write journal unique for the flash
+     *                      chip, empty to write without the journal (e.g. if
+     *                      the journal is stored on the target itself)
+     */
+    void flashImage(const fs::path& file, const fs::path& device,
+                    const std::string& journalName);
+
+    /**
+     * @brief Write the firmware image composed in memory to the flash drive.
+     *
+     * @param file        - path to the original firmware image
+     * @param image       - content to write
+     * @param device      - path to the MTD device
+     * @param journalName - name of the write journal, see above
+     */
+    void flashImage(const fs::path& file, const MappedMem& image,
+                    const fs::path& device, const std::string& journalName);
+
     Files files;     //! List of firmware files
     fs::path tmpdir; //! Temporary directory
+
+    std::vector<Verifier::Result> verification; //! Signature checks
 };
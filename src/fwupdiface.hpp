@@ -9,6 +9,16 @@
 
 namespace fs = std::filesystem;
 
+/**
+ * @brief Flash drives written by the updaters.
+ *        Updaters of different flash drives can work concurrently.
+ */
+enum class FlashResource
+{
+    bmc,  //! BMC flash drive
+    host, //! Host firmware flash drive (BIOS SPI or PNOR)
+};
+
 /**
  * @brief Firmware updater interface.
  */
@@ -16,6 +26,16 @@ struct FwUpdIFace
 {
     virtual ~FwUpdIFace() = default;
 
+    /**
+     * @brief Get the flash drive owned by this updater.
+     */
+    virtual FlashResource flashResource() const = 0;
+
+    /**
+     * @brief Check if updater has any firmware file to install.
+     */
+    virtual bool hasFiles() const = 0;
+
     /**
      * @brief Enable firmware guard
      */
@@ -43,6 +63,32 @@ struct FwUpdIFace
      */
     virtual bool add(const fs::path& file) = 0;
 
+    /**
+     * @brief Drop all the firmware files added before.
+     */
+    virtual void clear() = 0;
+
+    /**
+     * @brief Check if specified file can be flashed by this updater instance.
+     *        Only the file name is checked, the file may not exist yet.
+     *
+     * @param file - path to the firmware file.
+     * @return true if file is acceptable
+     */
+    virtual bool isFileFlashable(const fs::path& file) const = 0;
+
+    /**
+     * @brief Start the check of firmware files signatures in background.
+     *        The results are collected by the subsequent verify() call.
+     *
+     * @param pulicKey - Path to public key file
+     * @param hashFunc - Signature hash function
+     */
+    virtual void scheduleVerify(const fs::path& /*pulicKey*/,
+                                const std::string& /*hashFunc*/)
+    {
+    }
+
     /**
      * @brief Check signatures of firmware files.
      *
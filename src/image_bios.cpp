@@ -9,10 +9,10 @@
 
 #include "dbus.hpp"
 #include "fwupderr.hpp"
+#include "mappedmem.hpp"
 #ifdef INTEL_X722_SUPPORT
 #include "nvm_x722.hpp"
 #endif // INTEL_X722_SUPPORT
-#include "subprocess.hpp"
 #include "tracer.hpp"
 
 #ifdef USE_PCA9698_OEPOL
@@ -24,10 +24,15 @@ extern "C"
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
 #include <sys/ioctl.h>
-#include <unistd.h>
 #endif // USE_PCA9698_OEPOL
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
 #include <fstream>
 #include <thread>
 
@@ -53,11 +58,8 @@ static constexpr auto pca9698OEPolBit = 0x01;
 #endif // USE_PCA9698_OEPOL
 static constexpr size_t nvramOffset = 0x01000000;
 static constexpr size_t nvramSize = 0x00080000;
-static const char* nvramFile = "nvram.bin";
-static constexpr size_t ddBlockSize = 512;
 
 #ifdef INTEL_X722_SUPPORT
-static const char* gbeFile = "gbe.bin";
 bool BIOSUpdater::writeGbeOnly = false;
 #endif // INTEL_X722_SUPPORT
 
@@ -69,12 +71,125 @@ static bool isSPIDriverBound()
     return fs::exists(aspeedSMC / spiDriver) && fs::exists(mtdDevice);
 }
 
+/**
+ * @brief Watcher of the device node creation and removal.
+ *        The node and its parent directory are created by udev
+ *        asynchronously, so both directories on the path are watched.
+ */
+class DeviceWatch
+{
+  public:
+    DeviceWatch(const DeviceWatch&) = delete;
+    DeviceWatch& operator=(const DeviceWatch&) = delete;
+
+    /**
+     * @brief Start watching.
+     *
+     * @param node - path to the device node
+     *
+     * @throw FwupdateError in case of errors
+     */
+    DeviceWatch(const fs::path& node) :
+        node(node), fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    {
+        if (fd == -1)
+        {
+            throw FwupdateError("inotify_init failed, error=%d: %s", errno,
+                                strerror(errno));
+        }
+        addWatches();
+    }
+
+    ~DeviceWatch()
+    {
+        close(fd);
+    }
+
+    /**
+     * @brief Wait until the condition is met.
+     *
+     * @param condition - function to check the condition
+     * @param timeout   - max time to wait
+     *
+     * @return false if timeout expired
+     *
+     * @throw FwupdateError in case of errors
+     */
+    template <typename Condition>
+    bool wait(Condition condition, std::chrono::milliseconds timeout)
+    {
+        using namespace std::chrono;
+
+        // sysfs doesn't support inotify, recheck the state periodically
+        constexpr milliseconds recheckInterval(100);
+
+        const auto deadline = steady_clock::now() + timeout;
+        while (!condition())
+        {
+            const auto left =
+                duration_cast<milliseconds>(deadline - steady_clock::now());
+            if (left.count() <= 0)
+            {
+                return false;
+            }
+
+            pollfd pfd{fd, POLLIN, 0};
+            const int rc =
+                poll(&pfd, 1, std::min(left, recheckInterval).count());
+            if (rc == -1 && errno != EINTR)
+            {
+                throw FwupdateError("poll failed, error=%d: %s", errno,
+                                    strerror(errno));
+            }
+            if (rc > 0)
+            {
+                drainEvents();
+                addWatches();
+            }
+        }
+        return true;
+    }
+
+  private:
+    /**
+     * @brief Add watches for the existing directories of the node path.
+     *        Adding a watch for already watched directory is harmless.
+     */
+    void addWatches()
+    {
+        constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                  IN_MOVED_TO | IN_DELETE_SELF;
+        for (const auto& dir : {node.parent_path().parent_path(),
+                                node.parent_path()})
+        {
+            inotify_add_watch(fd, dir.c_str(), mask);
+        }
+    }
+
+    /**
+     * @brief Read all pending events, the state is checked separately.
+     */
+    void drainEvents()
+    {
+        alignas(inotify_event) char buf[4096];
+        while (read(fd, buf, sizeof(buf)) > 0)
+        {
+        }
+    }
+
+    fs::path node; //! Path to the device node
+    int fd;        //! inotify descriptor
+};
+
 /**
  * @brief Execute bind or unbind SPI driver using sysfs.
  */
 static void bindOrUnbindSPIDriver(bool action)
 {
     const std::string actionStr = action ? "bind" : "unbind";
+
+    // Start watching before the action to catch all changes
+    DeviceWatch watch(mtdDevice);
     std::ofstream file;
     file.exceptions(std::ofstream::failbit | std::ofstream::badbit |
                     std::ofstream::eofbit);
@@ -91,18 +206,12 @@ static void bindOrUnbindSPIDriver(bool action)
                             e.what());
     }
 
-    constexpr auto maxDriverBindingChecks = 100;
-    constexpr auto delayBetweenChecksMS = 20;
-    for (int i = 0; i < maxDriverBindingChecks; ++i)
+    constexpr std::chrono::milliseconds driverBindingTimeout(2000);
+    if (watch.wait([action]() { return isSPIDriverBound() == action; },
+                   driverBindingTimeout))
     {
-        if (isSPIDriverBound() == action)
-        {
-            // Operation completed.
-            return;
-        }
-
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(delayBetweenChecksMS));
+        // Operation completed.
+        return;
     }
 
     throw FwupdateError("The SPI driver %s timed out!",
@@ -177,6 +286,49 @@ static void releaseGPIO(gpiod::line& gpioLine)
     }
 }
 
+/**
+ * @brief Wait for ME booting.
+ *        If the ME readiness GPIO is configured, its edge events are awaited
+ *        with the max boot time as a timeout, otherwise the max boot time
+ *        is always awaited.
+ */
+static void waitForME()
+{
+    constexpr std::chrono::seconds meBootTimeout(ME_BOOT_TIMEOUT);
+#ifdef ME_READY_PIN
+    const auto deadline = std::chrono::steady_clock::now() + meBootTimeout;
+    try
+    {
+        // The line is released when the object goes out of scope
+        gpiod::line line = gpiod::find_line(ME_READY_PIN);
+        if (!line)
+        {
+            throw FwupdateError("GPIO line %s not found!", ME_READY_PIN);
+        }
+        line.request({gpioOwner, gpiod::line_request::EVENT_BOTH_EDGES, 0});
+
+        while (line.get_value() != ME_READY_VALUE)
+        {
+            const auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= left.zero() || !line.event_wait(left))
+            {
+                // ME is not ready, but the max boot time has expired
+                return;
+            }
+            line.event_read();
+        }
+        return;
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "Unable to check ME readiness: %s\n", e.what());
+    }
+    std::this_thread::sleep_until(deadline);
+#else
+    std::this_thread::sleep_for(meBootTimeout);
+#endif // ME_READY_PIN
+}
+
 #ifdef USE_PCA9698_OEPOL
 /**
  * @brief Open I2C device file
@@ -206,47 +358,57 @@ static int openI2CDevice(const fs::path& path, uint8_t addr)
 }
 #endif // USE_PCA9698_OEPOL
 
+/**
+ * @brief Read the region of the flash drive.
+ *
+ * @param flash  - flash drive
+ * @param offset - offset of the region
+ * @param size   - size of the region
+ *
+ * @return Region content
+ *
+ * @throw FwupdateError in case of errors
+ */
+static Buffer readRegion(FlashIFace& flash, size_t offset, size_t size)
+{
+    Buffer data(size);
+    flash.read(offset, data.data(), data.size());
+    return data;
+}
+
 #ifdef INTEL_X722_SUPPORT
 /**
- * @brief Dump GBE blob
+ * @brief Dump GBE blob from the flash drive
  *
- * @param source[in]      bundle filename or mtd device
- * @param destination[in] filename to write the dump
+ * @param flash[in] flash drive
+ *
+ * @return GBE blob
  *
  * @throw FwupdateError in case of errors
  */
-static void dumpGbe(const fs::path& source, const fs::path& destination)
+static Buffer dumpGbe(FlashIFace& flash)
 {
-    puts("Preserving 10GBE...");
-    std::string cmd =
-        strfmt("dd if=%s of=%s skip=%lu count=%lu", source.c_str(),
-               destination.c_str(), NvmX722::nvmOffset / ddBlockSize,
-               NvmX722::nvmSize / ddBlockSize);
-    int rc = system(cmd.c_str());
-    checkWaitStatus(rc, std::string());
-    if (!fs::exists(destination))
-    {
-        throw FwupdateError("Error reading 10GBE");
-    }
+    Tracer tracer("Preserving 10GBE");
+    auto gbe = readRegion(flash, NvmX722::nvmOffset, NvmX722::nvmSize);
+    tracer.addBytes(gbe.size());
+    tracer.done();
+    return gbe;
 }
 
 /**
  * @brief Write GBE blob to the flash drive
  *
- * @param img[in]    GBE blob image
- * @param device[in] mtd device
+ * @param flash[in] flash drive
+ * @param gbe[in]   GBE blob image, NvmX722::nvmSize bytes
  *
  * @throw FwupdateError in case of errors
  */
-static void flashGbe(const fs::path& image, const fs::path& device)
+static void flashGbe(FlashIFace& flash, const uint8_t* gbe)
 {
-    // mtd-util doesn't work with symlinks
-    const auto mtdDeviceReal = fs::canonical(device);
-    puts("Writing GBE...");
-    auto cmd = strfmt("mtd-util -d %s cp %s 0x%x", mtdDeviceReal.c_str(),
-                      image.c_str(), NvmX722::nvmOffset);
-    auto rc = system(cmd.c_str());
-    checkWaitStatus(rc, std::string());
+    Tracer tracer("Writing GBE");
+    writeRegion(flash, NvmX722::nvmOffset, gbe, NvmX722::nvmSize,
+                FwUpdBase::flashOptions, tracer);
+    tracer.done();
 }
 
 inline bool empty(const NvmX722::mac_t& mac)
@@ -277,6 +439,14 @@ inline size_t count(const NvmX722::MacAddresses& addrs)
 void BIOSUpdater::lock()
 {
     if (!files.empty())
+    {
+        lockFlash();
+    }
+}
+
+void BIOSUpdater::lockFlash()
+{
+    if (!locked)
     {
         if (isChassisOn())
         {
@@ -365,8 +535,7 @@ void BIOSUpdater::unlock()
             }
 #endif // USE_PCA9698_OEPOL
 
-            // Wait for ME booting
-            std::this_thread::sleep_for(std::chrono::seconds(10));
+            waitForME();
 
             // The GPIO is released.
             locked = false;
@@ -375,34 +544,70 @@ void BIOSUpdater::unlock()
     }
 }
 
+MappedMem BIOSUpdater::composeImage(const fs::path& file)
+{
+    // Private writable mapping: the package file is left untouched, only
+    // the modified pages are copied.
+    auto image = MappedMem::open(file, true);
+    auto data = static_cast<uint8_t*>(image.get());
+
+    if (!nvram.empty())
+    {
+        Tracer tracer("Restoring NVRAM");
+        if (image.size() < nvramOffset + nvram.size())
+        {
+            throw FwupdateError("The image %s doesn't contain NVRAM region",
+                                file.filename().c_str());
+        }
+        std::copy(nvram.begin(), nvram.end(), data + nvramOffset);
+        tracer.done();
+    }
+
+#ifdef INTEL_X722_SUPPORT
+    // modify BIOS image to preserve x722 MAC addresses
+    try
+    {
+        Tracer tracer("Preserving x722 MAC addresses");
+        auto mac = NvmX722(gbe.data(), gbe.size()).getMac();
+        NvmX722(image.get(), image.size()).setMac(mac);
+        tracer.done();
+    }
+    catch (const std::exception& ex)
+    {
+        throw FwupdateError("Unable to preserve x722 MAC: %s", ex.what());
+    }
+#endif // INTEL_X722_SUPPORT
+
+    return image;
+}
+
 void BIOSUpdater::doInstall(const fs::path& file)
 {
 #ifdef INTEL_X722_SUPPORT
     if (writeGbeOnly)
     {
-        const fs::path partFile(tmpdir / gbeFile);
-        dumpGbe(file, partFile);
-        flashGbe(partFile, mtdDevice);
+        auto image = MappedMem::open(file);
+        if (image.size() < NvmX722::nvmOffset + NvmX722::nvmSize)
+        {
+            throw FwupdateError("The image %s doesn't contain 10GBE region",
+                                file.filename().c_str());
+        }
+        auto flash = openFlash(mtdDevice);
+        flashGbe(*flash, static_cast<const uint8_t*>(image.get()) +
+                             NvmX722::nvmOffset);
     }
     else
     {
-        // modify BIOS image to preserve x722 MAC addresses
-        try
-        {
-            Tracer tracer("Preserving x722 MAC addresses");
-            auto mac = NvmX722(tmpdir / gbeFile).getMac();
-            NvmX722(file).setMac(mac);
-            tracer.done();
-        }
-        catch (const std::exception& ex)
-        {
-            throw FwupdateError("Unable to preserve x722 MAC: %s", ex.what());
-        }
 #endif // INTEL_X722_SUPPORT
+        auto image = composeImage(file);
+        // Both chips are written through the same device
+        std::string journalName = "bios";
 
 #ifdef GOLDEN_FLASH_SUPPORT
         if (useGoldenFlash)
         {
+            journalName = "bios-golden";
+
             Tracer tracer("Switching to golden flash");
 
             // This makes the BMC to reinit the driver which might be attached
@@ -418,10 +623,7 @@ void BIOSUpdater::doInstall(const fs::path& file)
         }
 #endif // GOLDEN_FLASH_SUPPORT
 
-        printf("Writing %s to %s\n", file.filename().c_str(), mtdDevice);
-        int rc = system(
-            strfmt(FLASHCP_CMD " -v %s %s", file.c_str(), mtdDevice).c_str());
-        checkWaitStatus(rc, "");
+        flashImage(file, image, mtdDevice, journalName);
 #ifdef INTEL_X722_SUPPORT
     }
 #endif // INTEL_X722_SUPPORT
@@ -436,23 +638,18 @@ void BIOSUpdater::doBeforeInstall(bool reset)
     }
 #endif // INTEL_X722_SUPPORT
 
+    auto flash = openFlash(mtdDevice);
+
     if (!reset)
     {
-        puts("Preserving NVRAM...");
-        const fs::path dumpFile(tmpdir / nvramFile);
-        const std::string cmd = strfmt(
-            "dd if=%s of=%s skip=%lu count=%lu", mtdDevice, dumpFile.c_str(),
-            nvramOffset / ddBlockSize, nvramSize / ddBlockSize);
-        const int rc = system(cmd.c_str());
-        checkWaitStatus(rc, std::string());
-        if (!fs::exists(dumpFile))
-        {
-            throw FwupdateError("Error reading NVRAM");
-        }
+        Tracer tracer("Preserving NVRAM");
+        nvram = readRegion(*flash, nvramOffset, nvramSize);
+        tracer.addBytes(nvram.size());
+        tracer.done();
     }
 
 #ifdef INTEL_X722_SUPPORT
-    dumpGbe(mtdDevice, tmpdir / gbeFile);
+    gbe = dumpGbe(*flash);
 #endif // INTEL_X722_SUPPORT
 }
 
@@ -465,23 +662,9 @@ bool BIOSUpdater::doAfterInstall(bool reset)
     }
 #endif // INTEL_X722_SUPPORT
 
-    // mtd-util doesn't work with symlinks
-    const fs::path mtdDeviceReal = fs::canonical(
-        fs::path(mtdDevice).parent_path() / fs::read_symlink(mtdDevice));
-
-    if (!reset)
+    if (!reset && nvram.empty())
     {
-        puts("Restoring NVRAM...");
-        const fs::path dumpFile(tmpdir / nvramFile);
-        if (!fs::exists(dumpFile))
-        {
-            throw FwupdateError("Dump for NVRAM partition not found");
-        }
-        const std::string cmd =
-            strfmt("mtd-util -d %s cp %s 0x%x", mtdDeviceReal.c_str(),
-                   dumpFile.c_str(), nvramOffset);
-        const int rc = system(cmd.c_str());
-        checkWaitStatus(rc, std::string());
+        throw FwupdateError("Dump for NVRAM partition not found");
     }
 
     // reset BIOS version for bios_active ID
@@ -496,148 +679,93 @@ bool BIOSUpdater::isFileFlashable(const fs::path& file) const
            (file.extension() == ".bin" || file.extension() == ".img");
 }
 
-void BIOSUpdater::readNvram(const std::string& file)
+Buffer BIOSUpdater::readNvram()
 {
-    BIOSUpdater upd(fs::temp_directory_path());
-    upd.files.push_back("dummy");
-    try
-    {
-        upd.lock();
+    lockFlash();
 
-        puts("Reading NVRAM...");
-        const std::string cmd =
-            strfmt("dd if=%s of=%s skip=%lu count=%lu", mtdDevice, file.c_str(),
-                   nvramOffset / ddBlockSize, nvramSize / ddBlockSize);
-        const int rc = system(cmd.c_str());
-        checkWaitStatus(rc, std::string());
+    Tracer tracer("Reading NVRAM");
+    auto flash = openFlash(mtdDevice);
+    auto data = readRegion(*flash, nvramOffset, nvramSize);
+    tracer.addBytes(data.size());
+    tracer.done();
 
-        upd.unlock();
-    }
-    catch (...)
-    {
-        try
-        {
-            upd.unlock();
-        }
-        catch (const std::exception& ex)
-        {
-            fprintf(stderr, "%s\n", ex.what());
-        }
-        throw;
-    }
+    return data;
 }
 
 void BIOSUpdater::writeNvram(const std::string& file)
 {
-    BIOSUpdater upd(fs::temp_directory_path());
-    upd.files.push_back("dummy");
-    try
+    auto data = MappedMem::open(file);
+    if (data.size() > nvramSize)
     {
-        upd.lock();
+        throw FwupdateError("The NVRAM file is too large (%zu > %zu)",
+                            data.size(), nvramSize);
+    }
 
-        Tracer tracer("Writing NVRAM");
-        const fs::path mtdDeviceReal = fs::canonical(
-            fs::path(mtdDevice).parent_path() / fs::read_symlink(mtdDevice));
-        const std::string cmd =
-            strfmt("mtd-util -v -d %s cp %s 0x%x", mtdDeviceReal.c_str(),
-                   file.c_str(), nvramOffset);
-        const int rc = system(cmd.c_str());
-        checkWaitStatus(rc, std::string());
-        tracer.done();
+    lockFlash();
 
-        upd.unlock();
-    }
-    catch (...)
-    {
-        try
-        {
-            upd.unlock();
-        }
-        catch (const std::exception& ex)
-        {
-            fprintf(stderr, "%s\n", ex.what());
-        }
-        throw;
-    }
+    Tracer tracer("Writing NVRAM");
+    auto flash = openFlash(mtdDevice);
+    writeRegion(*flash, nvramOffset, static_cast<const uint8_t*>(data.get()),
+                data.size(), flashOptions, tracer);
+    tracer.done();
 }
 
 void BIOSUpdater::resetHostMacAddrs()
 {
-    BIOSUpdater upd(fs::temp_directory_path());
-    upd.files.push_back("dummy");
-
-    try
     {
+        static constexpr auto resetMacPath =
+            "/xyz/openbmc_project/control/host0/boot/one_time";
+        static constexpr auto resetMacIface =
+            "xyz.openbmc_project.Control.Boot.ResetMAC";
+
+        Tracer tracer("Set ResetMAC flag");
 
+        auto objects = getObjects(resetMacPath, {resetMacIface});
+        if (!objects.empty())
+        {
+            setProperty(objects.begin()->first, resetMacPath, resetMacIface,
+                        "ResetMAC", true);
+        }
+        else
         {
-            static constexpr auto resetMacPath =
-                "/xyz/openbmc_project/control/host0/boot/one_time";
-            static constexpr auto resetMacIface =
-                "xyz.openbmc_project.Control.Boot.ResetMAC";
+            tracer.fail();
+            printf("WARNING: No service providing `ResetMAC` property "
+                   "found!\n");
+        }
 
-            Tracer tracer("Set ResetMAC flag");
+        tracer.done();
+    }
 
-            auto objects = getObjects(resetMacPath, {resetMacIface});
-            if (!objects.empty())
-            {
-                setProperty(objects.begin()->first, resetMacPath, resetMacIface,
-                            "ResetMAC", true);
-            }
-            else
-            {
-                tracer.fail();
-                printf("WARNING: No service providing `ResetMAC` property "
-                       "found!\n");
-            }
+#ifdef INTEL_X722_SUPPORT
+    auto fruMacAddrs = NvmX722::getMacFromFRU();
+    if (count(fruMacAddrs) > 0)
+    {
+        lockFlash();
 
-            tracer.done();
-        }
+        auto flash = openFlash(mtdDevice);
+        auto gbeData = dumpGbe(*flash);
 
-#ifdef INTEL_X722_SUPPORT
-        auto fruMacAddrs = NvmX722::getMacFromFRU();
-        if (count(fruMacAddrs) > 0)
         {
-            upd.lock();
-
-            const fs::path dumpFile = upd.tmpdir / gbeFile;
-            dumpGbe(mtdDevice, dumpFile);
+            Tracer tracer("Preserving x722 MAC addresses");
+            NvmX722 gbe(gbeData.data(), gbeData.size());
 
+            auto macAddrs = gbe.getMac();
+            for (size_t i = 0; i < fruMacAddrs.size(); ++i)
             {
-                Tracer tracer("Preserving x722 MAC addresses");
-                NvmX722 gbe(dumpFile);
-
-                auto macAddrs = gbe.getMac();
-                for (size_t i = 0; i < fruMacAddrs.size(); ++i)
+                if (!empty(fruMacAddrs[i]))
                 {
-                    if (!empty(fruMacAddrs[i]))
-                    {
-                        std::swap(macAddrs[i], fruMacAddrs[i]);
-                    }
+                    std::swap(macAddrs[i], fruMacAddrs[i]);
                 }
-                gbe.setMac(macAddrs);
-                tracer.done();
             }
-
-            flashGbe(dumpFile, mtdDevice);
-
-            upd.unlock();
-        }
-        else
-        {
-            printf("WARNING: No x722 MAC addresses found in FRU!\n");
+            gbe.setMac(macAddrs);
+            tracer.done();
         }
-#endif // INTEL_X722_SUPPORT
+
+        flashGbe(*flash, gbeData.data());
     }
-    catch (...)
+    else
     {
-        try
-        {
-            upd.unlock();
-        }
-        catch (const std::exception& ex)
-        {
-            fprintf(stderr, "%s\n", ex.what());
-        }
-        throw;
+        printf("WARNING: No x722 MAC addresses found in FRU!\n");
     }
+#endif // INTEL_X722_SUPPORT
 }
@@ -7,6 +7,10 @@
 
 #include <gpiod.hpp>
 
+#include <vector>
+
+using Buffer = std::vector<uint8_t>;
+
 /**
  * @brief Vegman's BIOS firmware updater.
  */
@@ -14,6 +18,11 @@ struct BIOSUpdater : public FwUpdBase
 {
     using FwUpdBase::FwUpdBase;
 
+    FlashResource flashResource() const override
+    {
+        return FlashResource::host;
+    }
+
     void reset() override
     {
         // Not supported yet.
@@ -26,12 +35,54 @@ struct BIOSUpdater : public FwUpdBase
     bool isFileFlashable(const fs::path& file) const override;
 
     static bool writeGbeOnly;
-    static void readNvram(const std::string& file);
-    static void writeNvram(const std::string& file);
-    static void resetHostMacAddrs();
+
+    /**
+     * @brief Read NVRAM of the host flash.
+     *        The operations on the host flash lock it if it isn't locked
+     *        yet and leave it locked until the unlock() call, so a batch of
+     *        operations pays for the lock/unlock cycle only once.
+     *
+     * @return NVRAM dump
+     */
+    Buffer readNvram();
+
+    /**
+     * @brief Write NVRAM from the file.
+     *
+     * @param file - path to the NVRAM dump
+     */
+    void writeNvram(const std::string& file);
+
+    /**
+     * @brief Replace host MAC addresses with values from FRU.
+     */
+    void resetHostMacAddrs();
 
   private:
+    /**
+     * @brief Shut down PCH and switch the host flash to BMC.
+     *        Does nothing if the flash is already locked.
+     */
+    void lockFlash();
+
+    /**
+     * @brief Compose the image to write in memory: put the preserved NVRAM
+     *        and x722 MAC addresses into the package image, so the flash
+     *        drive is written in a single pass.
+     *
+     * @param file - path to the BIOS image from the package
+     *
+     * @return Composed image
+     *
+     * @throw FwupdateError in case of errors
+     */
+    MappedMem composeImage(const fs::path& file);
+
     bool locked = false;
+    Buffer nvram; //! Preserved NVRAM region
+#ifdef INTEL_X722_SUPPORT
+    Buffer gbe; //! Preserved 10GBE region
+#endif // INTEL_X722_SUPPORT
     gpiod::line gpioPCHPower;
     gpiod::line gpioBIOSSel;
 #ifdef GOLDEN_FLASH_SUPPORT
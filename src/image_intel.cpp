@@ -8,14 +8,19 @@
 #include "image_intel.hpp"
 
 #include "dbus.hpp"
+#include "parser.hpp"
 #include "subprocess.hpp"
 #include "tracer.hpp"
 
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/mount.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <fstream>
-#include <regex>
 
 constexpr size_t IMAGE_A_ADDR = 0x20080000;
 constexpr size_t IMAGE_B_ADDR = 0x22480000;
@@ -95,7 +100,7 @@ using MountPoints = std::vector<std::pair<FileSystem, MountPoint>>;
 
 static MountPoints getMountPoints()
 {
-    /* This regexp gives MTD partitions and their mount points.
+    /* Get MTD partitions and their mount points.
      * For example:
      *   mtd:rwfs /tmp/.rwfs jffs2 rw,sync,relatime 0 0
      *   mtd:sofs /var/sofs jffs2 rw,sync,relatime 0 0
@@ -103,20 +108,21 @@ static MountPoints getMountPoints()
      *   {'mtd:rwfs', '/tmp/.rwfs'},
      *   {'mtd:sofs', '/var/sofs'}
      */
-    static const std::regex MTDPartsTmpl("^(mtd:\\w+)\\s+([^\\s]+)\\s+.*$");
+    constexpr std::string_view mtdPrefix = "mtd:";
     MountPoints mtdPartitions;
     std::ifstream mounts("/proc/mounts");
 
     if (mounts.is_open())
     {
         std::string line;
+        std::array<std::string_view, 3> fields;
         while (std::getline(mounts, line))
         {
-            std::smatch match;
-            if (std::regex_match(line, match, MTDPartsTmpl))
+            if (splitFields(line, fields) == fields.size() &&
+                fields[0].compare(0, mtdPrefix.size(), mtdPrefix) == 0 &&
+                isWord(fields[0].substr(mtdPrefix.size())))
             {
-                mtdPartitions.emplace_back(
-                    std::make_pair(match[1].str(), match[2].str()));
+                mtdPartitions.emplace_back(fields[0], fields[1]);
             }
         }
 
@@ -126,35 +132,119 @@ static MountPoints getMountPoints()
     return mtdPartitions;
 }
 
-static void unmountFilesystem(const std::string& filesystem)
+/**
+ * @brief Watch of the mount table changes.
+ */
+class MountWatch
+{
+  public:
+    MountWatch()
+    {
+        fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            throw FwupdateError("Unable to open mountinfo, error=%d: %s",
+                                errno, strerror(errno));
+        }
+        drain();
+    }
+
+    ~MountWatch()
+    {
+        close(fd);
+    }
+
+    /**
+     * @brief Wait for the mount table change.
+     *
+     * @param timeout - max time to wait
+     *
+     * @throw FwupdateError in case of errors
+     */
+    void wait(std::chrono::milliseconds timeout)
+    {
+        pollfd pfd{fd, POLLPRI, 0};
+        const int rc = poll(&pfd, 1, timeout.count());
+        if (rc == -1 && errno != EINTR)
+        {
+            throw FwupdateError("poll failed, error=%d: %s", errno,
+                                strerror(errno));
+        }
+        if (rc > 0)
+        {
+            drain();
+        }
+    }
+
+  private:
+    /**
+     * @brief Read the whole table, the pending event is cleared by reading.
+     */
+    void drain()
+    {
+        char buf[4096];
+        lseek(fd, 0, SEEK_SET);
+        while (read(fd, buf, sizeof(buf)) > 0)
+        {
+        }
+    }
+
+    int fd; //! Descriptor of the mountinfo file
+};
+
+/**
+ * @brief Unmount the filesystems.
+ *        The busy filesystems are retried on each mount table change, e.g.
+ *        when a nested mount is gone, and on the recheck interval.
+ *
+ * @param mountPoints - filesystems to unmount
+ *
+ * @throw FwupdateError in case of errors
+ */
+static void unmountFilesystems(MountPoints mountPoints)
 {
+    using namespace std::chrono;
+
     // Some systemd services may occupy the RW partition
     // resulting in a delay of up to 20 seconds. We should wait for them
     // before throwing an error.
-    constexpr auto maxTries = 40;  // Max number of tries to unmount
-    constexpr auto delay = 500000; // Delay in microseconds between tries
-
-    auto tryNumber = 0;
+    constexpr seconds timeout(20);
+    // The files being closed are not reported by the mount table
+    constexpr milliseconds recheckInterval(100);
 
+    MountWatch watch;
+    const auto deadline = steady_clock::now() + timeout;
     while (true)
     {
-        int rc = umount(filesystem.c_str());
-        if (rc < 0 && errno == EBUSY && tryNumber < maxTries)
-        {
-            tryNumber++;
-            usleep(delay);
-        }
-        else if (rc < 0)
+        auto it = mountPoints.begin();
+        while (it != mountPoints.end())
         {
-            throw FwupdateError("umount %s failed, error=%d: %s",
-                                filesystem.c_str(), errno, strerror(errno));
+            if (umount(it->second.c_str()) == 0)
+            {
+                it = mountPoints.erase(it);
+            }
+            else if (errno == EBUSY && steady_clock::now() < deadline)
+            {
+                ++it;
+            }
+            else
+            {
+                throw FwupdateError("umount %s failed, error=%d: %s",
+                                    it->second.c_str(), errno,
+                                    strerror(errno));
+            }
         }
-        else if (rc == 0)
+        if (mountPoints.empty())
         {
             break;
         }
+
+        const auto left =
+            duration_cast<milliseconds>(deadline - steady_clock::now());
+        watch.wait(std::clamp(left, milliseconds(0), recheckInterval));
     }
 }
+
 /**
  * @brief Stops all services which ones use the flash drive
  *        and unmount partitions from the flash drive.
@@ -167,22 +257,22 @@ static void releaseFlashDrive()
         "nv-sync.service",
     };
 
-    for (const auto& unit : units)
+    Tracer stopTracer("Stopping services");
+    stopUnits(units);
+    stopTracer.done();
+
+    auto mountPoints = getMountPoints();
+    if (!mountPoints.empty())
     {
-        if (doesUnitExist(unit))
+        std::string names;
+        for (const auto& pt : mountPoints)
         {
-            Tracer tracer("Stopping %s", unit.c_str());
-            stopUnit(unit);
-            tracer.done();
+            names += names.empty() ? "" : ", ";
+            names += pt.first;
         }
-    }
-
-    auto mountPoints = getMountPoints();
 
-    for (const auto& pt : mountPoints)
-    {
-        Tracer tracer("Unmounting %s", pt.first.c_str());
-        unmountFilesystem(pt.second);
+        Tracer tracer("Unmounting %s", names.c_str());
+        unmountFilesystems(std::move(mountPoints));
         tracer.done();
     }
 }
@@ -253,11 +343,10 @@ void IntelPlatformsUpdater::doInstall(const fs::path& file)
 
     if (mtd)
     {
-        // NOTE: This process may take a lot of time and we want to show the
-        //       progress from original flashcp output.
-        printf("Writing %s to %s\n", filename.c_str(), mtd);
-        int rc = system(strfmt(FLASHCP_CMD " -v %s %s", file.c_str(), mtd).c_str());
-        checkWaitStatus(rc, "");
+        // The whole flash drive holds the journal directory as well
+        const std::string journalName =
+            filename == "image-mtd" ? "" : fs::path(mtd).filename().string();
+        flashImage(file, mtd, journalName);
     }
     else
     {
@@ -282,6 +371,10 @@ bool IntelPlatformsUpdater::doAfterInstall(bool reset)
 
 bool IntelPlatformsUpdater::isFileFlashable(const fs::path& file) const
 {
-    static const std::regex image("^image-(mtd|runtime|u-boot)$");
-    return std::regex_match(file.filename().string(), image);
+    static constexpr std::array<std::string_view, 3> images = {
+        "image-mtd",
+        "image-runtime",
+        "image-u-boot",
+    };
+    return isOneOf(file.filename().native(), images);
 }
@@ -12,6 +12,11 @@ struct IntelPlatformsUpdater : public FwUpdBase
 {
     using FwUpdBase::FwUpdBase;
 
+    FlashResource flashResource() const override
+    {
+        return FlashResource::bmc;
+    }
+
     void reset() override;
     void doInstall(const fs::path& file) override;
     bool doAfterInstall(bool reset) override;
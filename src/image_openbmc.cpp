@@ -9,6 +9,7 @@
 
 #include "dbus.hpp"
 #include "fwupderr.hpp"
+#include "parser.hpp"
 #include "subprocess.hpp"
 #include "tracer.hpp"
 
@@ -16,7 +17,14 @@
 #define SERVICE_FACTORY_RESET                                                  \
     "obmc-flash-bmc-setenv@" ENV_FACTORY_RESET ".service"
 
-#include <regex>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 
 void OBMCPhosphorImageUpdater::reset()
 {
@@ -25,6 +33,102 @@ void OBMCPhosphorImageUpdater::reset()
     tracer.done();
 }
 
+/**
+ * @brief Copy the file content by the kernel and release the copied part of
+ *        the source, so the image is never held twice in memory.
+ *        The source keeps its size, but its content is lost.
+ *
+ * @param source      - path to the source file
+ * @param destination - path to the new file
+ * @param tracer      - tracer to report progress
+ *
+ * @throw FwupdateError in case of errors
+ */
+static void moveContent(const fs::path& source, const fs::path& destination,
+                        Tracer& tracer)
+{
+    constexpr size_t chunkSize = 1024 * 1024;
+
+    int in = open(source.c_str(), O_RDWR | O_CLOEXEC);
+    if (in == -1)
+    {
+        throw FwupdateError("open %s failed, error=%d: %s", source.c_str(),
+                            errno, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(in, &st) == -1)
+    {
+        int err = errno;
+        close(in);
+        throw FwupdateError("stat %s failed, error=%d: %s", source.c_str(),
+                            err, strerror(err));
+    }
+    int out = open(destination.c_str(),
+                   O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 0777);
+    if (out == -1)
+    {
+        int err = errno;
+        close(in);
+        throw FwupdateError("open %s failed, error=%d: %s",
+                            destination.c_str(), err, strerror(err));
+    }
+
+    const size_t size = st.st_size;
+    bool useSendfile = false;
+    int err = 0;
+    for (size_t pos = 0; pos < size;)
+    {
+        const size_t len = std::min(chunkSize, size - pos);
+        ssize_t rc;
+        if (useSendfile)
+        {
+            off_t offset = pos;
+            rc = sendfile(out, in, &offset, len);
+        }
+        else
+        {
+            loff_t offset = pos;
+            rc = copy_file_range(in, &offset, out, nullptr, len, 0);
+            if (rc == -1 && pos == 0 &&
+                (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                 errno == EINVAL))
+            {
+                // Not supported between these file systems
+                useSendfile = true;
+                continue;
+            }
+        }
+        if (rc == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            err = rc == 0 ? EIO : errno;
+            break;
+        }
+
+        // Errors are ignored: the file system may not support holes
+        fallocate(in, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, rc);
+
+        pos += rc;
+        tracer.addBytes(rc);
+        tracer.progress(pos, size);
+    }
+
+    close(in);
+    if (close(out) == -1 && !err)
+    {
+        err = errno;
+    }
+    if (err)
+    {
+        unlink(destination.c_str());
+        throw FwupdateError("Unable to write %s, error=%d: %s",
+                            destination.c_str(), err, strerror(err));
+    }
+}
+
 void OBMCPhosphorImageUpdater::doInstall(const fs::path& file)
 {
     Tracer tracer("Install %s", file.filename().c_str());
@@ -36,7 +140,14 @@ void OBMCPhosphorImageUpdater::doInstall(const fs::path& file)
     {
         fs::remove_all(destination);
     }
-    fs::copy(file, destination);
+
+    // The unpacked image is not used after the installation, so its data is
+    // given to the destination instead of being copied: a hard link works
+    // within one file system, otherwise the content is moved by chunks.
+    if (link(file.c_str(), destination.c_str()) == -1)
+    {
+        moveContent(file, destination, tracer);
+    }
 
     tracer.done();
 }
@@ -62,6 +173,9 @@ bool OBMCPhosphorImageUpdater::doAfterInstall(bool reset)
 
 bool OBMCPhosphorImageUpdater::isFileFlashable(const fs::path& file) const
 {
-    static const std::regex image("^image-(bmc|kernel|rofs|rwfs|u-boot)$");
-    return std::regex_match(file.filename().string(), image);
+    static constexpr std::array<std::string_view, 5> images = {
+        "image-bmc",  "image-kernel", "image-rofs",
+        "image-rwfs", "image-u-boot",
+    };
+    return isOneOf(file.filename().native(), images);
 }
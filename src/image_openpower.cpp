@@ -9,51 +9,16 @@
 
 #include "dbus.hpp"
 #include "fwupderr.hpp"
+#include "mappedmem.hpp"
+#include "pnor.hpp"
 #include "subprocess.hpp"
 #include "tracer.hpp"
 
-#include <map>
-#include <regex>
-
-// Map of PNOR partitions as partition name -> flag is it should use ECC clear
-using PartsMap = std::map<std::string, bool>;
-
-static const std::regex PnorPartInfo("^ID=\\d+\\s+(\\w+)\\s.*\\[([^\\]]+)\\]$");
-
-PartsMap getPartsToClear(const std::string& info)
-{
-    PartsMap ret;
-    std::istringstream iss(info);
-    std::string line;
-
-    while (std::getline(iss, line))
-    {
-        // Each line looks like
-        // ID=06 MVPD 0x0012d000..0x001bd000 (actual=0x00090000) [E--P--F-C-]
-        // Flag 'F' means REPROVISION
-        // Flag 'E' means ECC required
-
-        std::smatch match;
-        if (std::regex_match(line, match, PnorPartInfo))
-        {
-            const auto& name = match[1].str();
-            const auto& flags = match[2].str();
-
-            if (flags.find('F') != std::string::npos)
-            {
-                ret[name] = flags.find('E') != std::string::npos;
-            }
-        }
-    }
-
-    return ret;
-}
-
-// Get partitions that should be cleared
-PartsMap getPartsToClear()
-{
-    return getPartsToClear(exec("%s -i 2>/dev/null", PFLASH_CMD));
-}
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <optional>
 
 /**
  * @brief Get HIOMPAD bus name.
@@ -93,6 +58,11 @@ static uint8_t hiomapDaemonState()
 
 void OpenPowerUpdater::lock()
 {
+    if (locked)
+    {
+        return;
+    }
+
     Tracer tracer("Suspending HIOMAPD");
 
     if (isChassisOn())
@@ -102,6 +72,7 @@ void OpenPowerUpdater::lock()
 
     if (hiomapDaemonState() == 0)
     {
+        BusLock busLock(systemBusMutex);
         auto req = systemBus.new_method_call(hiomapd().c_str(), HIOMAPD_PATH,
                                              HIOMAPD_IFACE, "Suspend");
         systemBus.call(req);
@@ -121,6 +92,7 @@ void OpenPowerUpdater::unlock()
     {
         Tracer tracer("Resuming HIOMAPD");
 
+        BusLock busLock(systemBusMutex);
         auto req = systemBus.new_method_call(hiomapd().c_str(), HIOMAPD_PATH,
                                              HIOMAPD_IFACE, "Resume");
         req.append(true);
@@ -133,78 +105,237 @@ void OpenPowerUpdater::unlock()
 
 void OpenPowerUpdater::reset()
 {
-    auto partitions = getPartsToClear();
+    auto flash = openFlash(PNOR_MTD_DEVICE);
+    const auto toc = PnorToc::read(*flash);
+
+    std::vector<PnorPartition> partitions;
+    std::copy_if(toc.partitions().begin(), toc.partitions().end(),
+                 std::back_inserter(partitions),
+                 [](const auto& p) { return p.reprovision; });
     if (partitions.empty())
     {
         printf("NOTE: No partitions found on the PNOR flash!\n");
+        return;
     }
 
-    for (auto p : partitions)
-    {
-        Tracer tracer("Clear %s partition [%s]", p.first.c_str(),
-                      p.second ? "ECC" : "Erase");
-        std::ignore = exec("%s -P %s -%c -f 2>&1", PFLASH_CMD, p.first.c_str(),
-                           p.second ? 'c' : 'e');
-        tracer.done();
-    }
+    clearPartitions(*flash, partitions, flashOptions);
 }
 
 static const std::vector<std::string> partsToPreserve = {
     "NVRAM",
 };
 
-void OpenPowerUpdater::doBeforeInstall(bool reset)
+/**
+ * @brief Check if the flash has the same partition table as the image.
+ *
+ * @param image     - partition table of the image
+ * @param imageSize - size of the image
+ * @param flashToc  - partition table of the flash
+ * @param flashSize - size of the flash
+ */
+static bool isSameLayout(const PnorToc& image, size_t imageSize,
+                         const PnorToc& flashToc, size_t flashSize)
 {
-    if (!files.empty() && !reset)
+    const auto& lhs = image.partitions();
+    const auto& rhs = flashToc.partitions();
+    if (lhs.size() != rhs.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < lhs.size(); ++i)
     {
-        for (const auto& part : partsToPreserve)
+        const auto& a = lhs[i];
+        const auto& b = rhs[i];
+        if (a.name != b.name || a.offset != b.offset || a.size != b.size ||
+            a.ecc != b.ecc || a.offset + a.size > imageSize ||
+            a.offset + a.size > flashSize)
         {
-            Tracer tracer("Preserve %s configuration", part.c_str());
+            return false;
+        }
+    }
 
-            auto partFile(tmpdir / part);
-            std::ignore = exec("%s -P %s -r %s 2>&1", PFLASH_CMD, part.c_str(),
-                               partFile.c_str());
+    return true;
+}
 
-            if (!fs::exists(partFile))
-            {
-                tracer.fail();
-                printf("NOTE: Preserving %s failed, default settings will be "
-                       "used.\n",
-                       part.c_str());
-            }
-            else
-            {
-                tracer.done();
-            }
+/**
+ * @brief Check if the flash range has the same content as the image.
+ *
+ * @param flash  - PNOR flash drive
+ * @param offset - offset of the range
+ * @param data   - image data of the range
+ * @param size   - size of the range
+ * @param tracer - tracer to report progress
+ */
+static bool isSameContent(FlashIFace& flash, size_t offset,
+                          const uint8_t* data, size_t size, Tracer& tracer)
+{
+    constexpr size_t chunkSize = 1024 * 1024;
+    std::vector<uint8_t> current(std::min(size, chunkSize));
+
+    for (size_t pos = 0; pos < size; pos += current.size())
+    {
+        const size_t len = std::min(size - pos, current.size());
+        flash.read(offset + pos, current.data(), len);
+        tracer.addBytes(len);
+        if (memcmp(current.data(), data + pos, len) != 0)
+        {
+            return false;
         }
+        tracer.progress(pos + len, size);
     }
+
+    return true;
 }
 
-void OpenPowerUpdater::doInstall(const fs::path& file)
+bool OpenPowerUpdater::updatePartitions(const fs::path& file)
 {
-    // NOTE: This process may take a lot of time and we want to show the
-    //       progress from original pflash output.
-    printf("Writing %s ... \n", file.filename().c_str());
-    int rc = system(strfmt("%s -f -E -p %s", PFLASH_CMD, file.c_str()).c_str());
-    checkWaitStatus(rc, "");
+    const auto image = MappedMem::open(file);
+    const auto* data = static_cast<const uint8_t*>(image.get());
+    auto flash = openFlash(PNOR_MTD_DEVICE);
+
+    std::optional<PnorToc> imageToc, flashToc;
+    try
+    {
+        imageToc.emplace(data, image.size());
+        flashToc.emplace(PnorToc::read(*flash));
+    }
+    catch (const FwupdateError& e)
+    {
+        printf("NOTE: %s, the whole flash will be written.\n", e.what());
+        return false;
+    }
+    if (!isSameLayout(*imageToc, image.size(), *flashToc, flash->size()))
+    {
+        printf("NOTE: PNOR partition table was changed, the whole flash will "
+               "be written.\n");
+        return false;
+    }
+
+    for (const auto& part : imageToc->partitions())
+    {
+        if (preserve && std::find(partsToPreserve.begin(),
+                                  partsToPreserve.end(),
+                                  part.name) != partsToPreserve.end())
+        {
+            continue;
+        }
+
+        Tracer tracer("Update %s partition", part.name.c_str());
+        const uint8_t* partData = data + part.offset;
+        if (isSameContent(*flash, part.offset, partData, part.size, tracer))
+        {
+            tracer.skip();
+            continue;
+        }
+        writeRegion(*flash, part.offset, partData, part.size, flashOptions,
+                    tracer);
+        tracer.done();
+    }
+
+    return true;
+}
+
+void OpenPowerUpdater::preserveConfig()
+{
+    for (const auto& part : partsToPreserve)
+    {
+        Tracer tracer("Preserve %s configuration", part.c_str());
+
+        auto partFile(tmpdir / part);
+        std::ignore = exec("%s -P %s -r %s 2>&1", PFLASH_CMD, part.c_str(),
+                           partFile.c_str());
+
+        if (!fs::exists(partFile))
+        {
+            tracer.fail();
+            printf("NOTE: Preserving %s failed, default settings will be "
+                   "used.\n",
+                   part.c_str());
+        }
+        else
+        {
+            tracer.done();
+        }
+    }
 }
 
-bool OpenPowerUpdater::doAfterInstall(bool reset)
+void OpenPowerUpdater::recoverConfig()
 {
-    if (!reset && !files.empty())
+    for (const auto& part : partsToPreserve)
     {
-        for (const auto& part : partsToPreserve)
+        auto partFile(tmpdir / part);
+        if (fs::exists(partFile))
         {
-            auto partFile(tmpdir / part);
-            if (fs::exists(partFile))
+            Tracer tracer("Recover %s configuration", part.c_str());
+            std::ignore = exec("%s -f -e -P %s -p %s 2>&1", PFLASH_CMD,
+                               part.c_str(), partFile.c_str());
+            fs::remove(partFile);
+            tracer.done();
+        }
+    }
+}
+
+void OpenPowerUpdater::doBeforeInstall(bool reset)
+{
+    preserve = !reset;
+}
+
+void OpenPowerUpdater::doInstall(const fs::path& file)
+{
+    // Unchanged partitions and the user configuration are left untouched
+    if (flashOptions.incremental && updatePartitions(file))
+    {
+        return;
+    }
+
+    if (preserve)
+    {
+        preserveConfig();
+    }
+
+    // NOTE: This process may take a lot of time, the progress is taken
+    //       from the pflash output as it arrives.
+    Tracer tracer("Writing %s", file.filename().c_str());
+    tracer.addBytes(fs::file_size(file));
+
+    // Each progress bar of pflash ends with the percentage
+    std::string output;
+    size_t number = 0;
+    bool digits = false;
+    Subprocess pflash(
+        strfmt("%s -f -E -p %s 2>&1", PFLASH_CMD, file.c_str()).c_str(),
+        [&](const char* data, size_t size) {
+            output.append(data, size);
+            for (size_t i = 0; i < size; ++i)
             {
-                Tracer tracer("Recover %s configuration", part.c_str());
-                std::ignore = exec("%s -f -e -P %s -p %s 2>&1", PFLASH_CMD,
-                                   part.c_str(), partFile.c_str());
-                tracer.done();
+                if (isdigit(data[i]))
+                {
+                    number = std::min<size_t>(number * 10 + data[i] - '0',
+                                              1000);
+                    digits = true;
+                    continue;
+                }
+                if (data[i] == '%' && digits && number <= 100)
+                {
+                    tracer.progress(number, 100);
+                }
+                number = 0;
+                digits = false;
             }
-        }
+        });
+    checkWaitStatus(pflash.wait(), output);
+
+    tracer.done();
+
+    if (preserve)
+    {
+        recoverConfig();
     }
+}
+
+bool OpenPowerUpdater::doAfterInstall(bool)
+{
     return false;
 }
 
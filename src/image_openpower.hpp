@@ -14,6 +14,11 @@ struct OpenPowerUpdater : public FwUpdBase
 {
     using FwUpdBase::FwUpdBase;
 
+    FlashResource flashResource() const override
+    {
+        return FlashResource::host;
+    }
+
     void lock() override;
     void unlock() override;
     void reset() override;
@@ -23,5 +28,28 @@ struct OpenPowerUpdater : public FwUpdBase
     bool isFileFlashable(const fs::path& file) const override;
 
   private:
-    bool locked = false;
+    /**
+     * @brief Save the partitions with the user configuration.
+     */
+    void preserveConfig();
+
+    /**
+     * @brief Write back the saved partitions with the user configuration.
+     */
+    void recoverConfig();
+
+    /**
+     * @brief Rewrite only the changed partitions of the PNOR flash.
+     *        The update is possible only if the image has the same partition
+     *        table as the flash. The partitions with the user configuration
+     *        are kept untouched unless reset is requested.
+     *
+     * @param file - path to the PNOR image
+     *
+     * @return false if the partition tables differ
+     */
+    bool updatePartitions(const fs::path& file);
+
+    bool locked = false;   //! HIOMAPD is suspended
+    bool preserve = false; //! Keep the user configuration on install
 };
@@ -0,0 +1,117 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "config.h"
+
+#include "journal.hpp"
+
+#include "fwupderr.hpp"
+#include "signature.hpp"
+#include "strfmt.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+static constexpr auto journalHashFunc = "sha256";
+static constexpr auto targetTag = "target=";
+static constexpr auto digestTag = "digest=";
+static constexpr auto sizeTag = "size=";
+static constexpr auto writtenTag = "written=";
+
+fs::path WriteJournal::directory = JOURNAL_DIR;
+
+WriteJournal::WriteJournal(const std::string& name, const fs::path& target,
+                           const uint8_t* data, size_t size) :
+    file(directory / (name + ".journal")), target(target), size(size)
+{
+    Digest hash(journalHashFunc);
+    hash.update(data, size);
+    for (const auto byte : hash.final())
+    {
+        digest += strfmt("%02x", byte).c_str();
+    }
+
+    const std::string header = std::string(targetTag) + this->target + '\n' +
+                               digestTag + digest + '\n' + sizeTag +
+                               std::to_string(size) + '\n';
+
+    std::ifstream in(file);
+    const std::string content((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    if (content.compare(0, header.size(), header) == 0)
+    {
+        const std::string tail = content.substr(header.size());
+        if (tail.compare(0, strlen(writtenTag), writtenTag) == 0)
+        {
+            const size_t value =
+                strtoull(tail.c_str() + strlen(writtenTag), nullptr, 10);
+            done = std::min(value, size);
+        }
+    }
+}
+
+size_t WriteJournal::written() const
+{
+    return done;
+}
+
+void WriteJournal::commit(size_t size)
+{
+    if (failed)
+    {
+        return;
+    }
+
+    const std::string content = strfmt("%s%s\n%s%s\n%s%zu\n%s%zu\n",
+                                       targetTag, target.c_str(), digestTag,
+                                       digest.c_str(), sizeTag, this->size,
+                                       writtenTag, size)
+                                    .c_str();
+
+    // Replace the journal atomically, the data must reach the storage
+    // before the next chunk is written
+    fs::path tmpFile(file);
+    tmpFile += ".tmp";
+    mkdir(file.parent_path().c_str(), 0700);
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    bool ok = fd != -1 &&
+              write(fd, content.data(), content.size()) ==
+                  static_cast<ssize_t>(content.size()) &&
+              fsync(fd) == 0;
+    const int err = errno;
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    ok = ok && rename(tmpFile.c_str(), file.c_str()) == 0;
+
+    if (ok)
+    {
+        done = size;
+    }
+    else
+    {
+        fprintf(stderr, "WARNING: Unable to save the write journal %s: %s\n",
+                file.c_str(), strerror(err ? err : errno));
+        unlink(tmpFile.c_str());
+        failed = true;
+    }
+}
+
+void WriteJournal::complete() noexcept
+{
+    unlink(file.c_str());
+    done = 0;
+}
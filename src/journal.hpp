@@ -0,0 +1,62 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include "flash.hpp"
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Persistent journal of the image write to the flash drive.
+ *        The journal describes the target, the digest of the image and the
+ *        size of the data written and verified. It is saved atomically after
+ *        each written chunk, so the write interrupted by a power loss or a
+ *        killed process is resumed by the next run instead of starting from
+ *        scratch.
+ */
+class WriteJournal : public FlashJournal
+{
+  public:
+    /**
+     * @brief Load the journal of the target.
+     *        The progress saved before is used only if it was saved for the
+     *        same image.
+     *
+     * @param name   - name of the journal, unique for each flash chip
+     * @param target - path to the target flash drive
+     * @param data   - image data
+     * @param size   - size of the image
+     */
+    WriteJournal(const std::string& name, const fs::path& target,
+                 const uint8_t* data, size_t size);
+
+    size_t written() const override;
+
+    /**
+     * @brief Save the progress of the write.
+     *        Errors are reported once and ignored: the journal is only an
+     *        optimization.
+     */
+    void commit(size_t size) override;
+
+    /**
+     * @brief Remove the journal after the successful write.
+     */
+    void complete() noexcept;
+
+    static fs::path directory; //! Directory of the journal files
+
+  private:
+    fs::path file;       //! Path to the journal file
+    std::string target;  //! Path to the target flash drive
+    std::string digest;  //! Digest of the image as hex string
+    size_t size;         //! Size of the image
+    size_t done = 0;     //! Size of the data written and verified
+    bool failed = false; //! Journal can't be saved
+};
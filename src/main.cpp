@@ -6,8 +6,10 @@
 #include "config.h"
 
 #include "confirm.hpp"
+#include "daemon.hpp"
 #include "dbus.hpp"
 #include "fwupdate.hpp"
+#include "fwupdbase.hpp"
 #include "fwupderr.hpp"
 #include "subprocess.hpp"
 #include "tracer.hpp"
@@ -18,6 +20,7 @@
 
 #include <getopt.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -25,6 +28,7 @@
 #include <filesystem>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -32,57 +36,72 @@ namespace fs = std::filesystem;
 bool useGoldenFlash = false;
 #endif // GOLDEN_FLASH_SUPPORT
 
+// Forward requests to the firmware updater service
+static bool useDaemon = false;
+// Name of the flash verification mode to pass to the service
+static std::string verifyMode = "readback";
+
 /**
  * @brief Prints version details of all active software objects.
  */
 static void showVersion()
 {
-    auto tree = getSubTree(SOFTWARE_OBJPATH, {ACTIVATION_IFACE});
-    for (auto& treeEntry : tree)
+    using Properties = PropertiesMap<std::variant<std::string>>;
+    constexpr size_t queriesPerObject = 3;
+
+    // Properties of all objects are requested in a single batch
+    std::vector<PropertiesQuery> queries;
+    for (auto& treeEntry : getSubTree(SOFTWARE_OBJPATH, {ACTIVATION_IFACE}))
     {
         for (auto& busEntry : treeEntry.second)
         {
-            auto activation =
-                getProperty<std::string>(busEntry.first, treeEntry.first,
-                                         ACTIVATION_IFACE, "Activation");
-            if (activation != ACTIVATION_IFACE ".Activations.Active")
+            for (const auto iface :
+                 {ACTIVATION_IFACE, VERSION_IFACE, EXTENDED_VERSION_IFACE})
             {
-                continue;
+                queries.push_back({busEntry.first, treeEntry.first, iface});
             }
+        }
+    }
+    auto properties = getAllProperties<std::variant<std::string>>(queries);
 
-            auto purpose = getProperty<std::string>(
-                busEntry.first, treeEntry.first, VERSION_IFACE, "Purpose");
-            auto version = getProperty<std::string>(
-                busEntry.first, treeEntry.first, VERSION_IFACE, "Version");
+    auto getString = [](const Properties& props, const PropertyName& name) {
+        auto it = props.find(name);
+        return it != props.end() ? std::get<std::string>(it->second)
+                                 : std::string();
+    };
 
-            printf("%-6s  %s   [ID=%s]\n",
-                   purpose.c_str() + purpose.rfind('.') + 1, version.c_str(),
-                   treeEntry.first.c_str() + treeEntry.first.rfind('/') + 1);
+    for (size_t i = 0; i < queries.size(); i += queriesPerObject)
+    {
+        const auto& path = queries[i].path;
+        const auto& activation = properties[i];
+        const auto& version = properties[i + 1];
+        const auto& extended = properties[i + 2];
 
-            try
-            {
-                auto extVersion = getProperty<std::string>(
-                    busEntry.first, treeEntry.first, EXTENDED_VERSION_IFACE,
-                    "ExtendedVersion");
-                size_t begin = 0;
-                while (begin != std::string::npos)
-                {
-                    size_t end = extVersion.find(',', begin);
-                    printf("        %s\n",
-                           extVersion.substr(begin, end - begin).c_str());
-
-                    if (end != std::string::npos)
-                    {
-                        end++;
-                    }
-                    begin = end;
-                }
-            }
-            catch (const std::runtime_error&)
+        if (getString(activation, "Activation") !=
+            ACTIVATION_IFACE ".Activations.Active")
+        {
+            continue;
+        }
+
+        auto purpose = getString(version, "Purpose");
+        printf("%-6s  %s   [ID=%s]\n", purpose.c_str() + purpose.rfind('.') + 1,
+               getString(version, "Version").c_str(),
+               path.c_str() + path.rfind('/') + 1);
+
+        // NOTE: Only PNOR contains the Extended Version field.
+        auto extVersion = getString(extended, "ExtendedVersion");
+        size_t begin = extVersion.empty() ? std::string::npos : 0;
+        while (begin != std::string::npos)
+        {
+            size_t end = extVersion.find(',', begin);
+            printf("        %s\n",
+                   extVersion.substr(begin, end - begin).c_str());
+
+            if (end != std::string::npos)
             {
-                // NOTE: Only PNOR contains the Extended Version field.
-                continue;
+                end++;
             }
+            begin = end;
         }
     }
 }
@@ -138,9 +157,15 @@ void resetFirmware(bool interactive, bool force)
         return;
     }
 
-    FwUpdate fwupdate(force);
-
-    fwupdate.reset();
+    if (useDaemon)
+    {
+        callDaemon("Reset", force);
+    }
+    else
+    {
+        FwUpdate fwupdate(force);
+        fwupdate.reset();
+    }
 
     reboot(interactive);
 }
@@ -154,9 +179,12 @@ void resetFirmware(bool interactive, bool force)
  * @param skipSignCheck - flag to skip signature verification.
  * @param skipMTCheck   - flag to skip machine type comparison.
  * @param force         - flag to flash without lock
+ * @param pipeline      - flag to flash each firmware as soon as its
+ *                        signature is verified
  */
 void flashFirmware(const fs::path& firmwareFile, bool reset, bool interactive,
-                   bool skipSignCheck, bool skipMTCheck, bool force)
+                   bool skipSignCheck, bool skipMTCheck, bool force,
+                   bool pipeline)
 {
     if (!fs::exists(firmwareFile))
     {
@@ -181,12 +209,27 @@ void flashFirmware(const fs::path& firmwareFile, bool reset, bool interactive,
         }
     }
 
+    if (useDaemon)
+    {
+        bool rebootRequired = false;
+        callDaemon("Verify", fs::absolute(firmwareFile).string(), force,
+                   skipSignCheck, skipMTCheck, pipeline);
+        callDaemon("Install", reset, FwUpdBase::flashOptions.incremental,
+                   verifyMode)
+            .read(rebootRequired);
+        if (rebootRequired)
+        {
+            reboot(interactive);
+        }
+        return;
+    }
+
     FwUpdate fwupdate(force);
     fwupdate.unpack(firmwareFile);
 
     if (!skipSignCheck)
     {
-        fwupdate.verify();
+        fwupdate.verify(pipeline);
     }
 
     if (!skipMTCheck)
@@ -200,6 +243,121 @@ void flashFirmware(const fs::path& firmwareFile, bool reset, bool interactive,
     }
 }
 
+/**
+ * @brief Operation of the batch.
+ */
+struct Operation
+{
+    int option;       //! Command line option of the operation
+    std::string file; //! File argument of the option
+};
+
+/**
+ * @brief Run the batch of operations in a single locked session.
+ *        Operations are executed in the order of the command line options,
+ *        the flash drives are locked once for the whole batch.
+ *
+ * @param batch         - operations to run
+ * @param reset         - flag to drop current settings.
+ * @param interactive   - flag to use interactive mode.
+ * @param skipSignCheck - flag to skip signature verification.
+ * @param skipMTCheck   - flag to skip machine type comparison.
+ * @param force         - flag to flash without lock
+ * @param pipeline      - flag to flash each firmware as soon as its
+ *                        signature is verified
+ */
+static void runBatch(const std::vector<Operation>& batch, bool reset,
+                     bool interactive, bool skipSignCheck, bool skipMTCheck,
+                     bool force, bool pipeline)
+{
+    std::string title("WARNING: The following operations will be done:\n");
+    for (const auto& op : batch)
+    {
+        switch (op.option)
+        {
+            case 'f':
+                if (!fs::exists(op.file))
+                {
+                    throw FwupdateError("Firmware package %s not found!",
+                                        op.file.c_str());
+                }
+                title += "  update firmware from " + op.file + "\n";
+                break;
+            case 'r':
+                title += "  reset all settings to manufacturing default\n";
+                break;
+#ifdef INTEL_C62X_SUPPORT
+            case 'R':
+                title += "  replace host MAC addresses with values from FRU\n";
+                break;
+            case 'n':
+                title += "  read NVRAM to " + op.file + "\n";
+                break;
+            case 'w':
+                title += "  write NVRAM from " + op.file + "\n";
+                break;
+#endif // INTEL_C62X_SUPPORT
+        }
+    }
+    if (reset)
+    {
+        title += "All settings will be restored to manufacture default "
+                 "values.\n";
+    }
+    title += "Please do not turn off the system during update!";
+
+    if (interactive && !confirm(title.c_str()))
+    {
+        return;
+    }
+
+    bool rebootRequired = false;
+    FwUpdate fwupdate(force);
+    fwupdate.beginBatch();
+    for (const auto& op : batch)
+    {
+        switch (op.option)
+        {
+            case 'f':
+                fwupdate.unpack(op.file);
+                if (!skipSignCheck)
+                {
+                    fwupdate.verify(pipeline);
+                }
+                if (!skipMTCheck)
+                {
+                    fwupdate.checkMachineType();
+                }
+                if (fwupdate.install(reset))
+                {
+                    rebootRequired = true;
+                }
+                break;
+            case 'r':
+                fwupdate.reset();
+                rebootRequired = true;
+                break;
+#ifdef INTEL_C62X_SUPPORT
+            case 'R':
+                fwupdate.resetHostMacAddrs();
+                break;
+            case 'n':
+                fwupdate.readNvram(op.file);
+                break;
+            case 'w':
+                fwupdate.writeNvram(op.file);
+                break;
+#endif // INTEL_C62X_SUPPORT
+        }
+    }
+    fwupdate.endBatch();
+
+    if (rebootRequired)
+    {
+        reboot(interactive);
+    }
+}
+
 /**
  * @brief Print usage
  *
@@ -207,10 +365,12 @@ void flashFirmware(const fs::path& firmwareFile, bool reset, bool interactive,
  */
 static void printUsage(const char* app)
 {
-    printf("\nUsage: %s [-h] [-f FILE] [-r] [-s] [-m] [-y] [-v]\n", app);
+    printf("\nUsage: %s [-h] [-f FILE] [-r] [-s] [-m] [-i] [-V MODE] [-p] "
+           "[-S FILE] [-y] [-v] [-D]\n",
+           app);
     printf(R"(optional arguments:
   -h, --help        show this help message and exit
-  -f, --file FILE   path to the firmware file
+  -f, --file FILE   path to the firmware file, the option can be repeated
   -r, --reset       reset all settings to manufacturing default, this option
                     can be combined with -f or used as standalone command to
                     reset RW partition of OpenBMC and clean some partitions of
@@ -219,8 +379,28 @@ static void printUsage(const char* app)
   -m, --no-machine-type
                     disable machine type comparison
   -F, --force       forced flash/reset firmware
+  -i, --incremental write only changed erase blocks of the flash drive, for
+                    PNOR flash only changed partitions are written while
+                    NVRAM is kept untouched
+  -V, --verify MODE check of the data written by the native flash writer:
+                    readback - compare the readback with the image (default)
+                    digest   - compare digests of all erase blocks in
+                               background while the next data is written
+                    sample   - compare digests of each 16th erase block in
+                               background and the digest of the whole
+                               written range at the end
+  -p, --pipeline    start flashing each firmware as soon as its signature
+                    is verified, while other images are still being checked
+  -S, --stats FILE  append duration and throughput of each step to the file
+                    as JSON lines
   -y, --yes         don't ask user for confirmation
   -v, --version     print installed firmware version info and exit
+  -D, --daemon      run as D-Bus service, while the service is running other
+                    invocations forward their requests to it
+
+Several firmware files and NVRAM operations can be combined in a single
+invocation, they are run in the order of the options while the flash drives
+are locked only once.
 )");
 #ifdef GOLDEN_FLASH_SUPPORT
     printf("  -a, --alt-mtd     operate on the alternate flash chip "
@@ -262,8 +442,15 @@ int main(int argc, char* argv[])
         { "no-machine-type",
                      no_argument,       0, 'm' },
         { "force",   no_argument,       0, 'F' },
+        { "incremental",
+                     no_argument,       0, 'i' },
+        { "verify",  required_argument, 0, 'V' },
+        { "pipeline",
+                     no_argument,       0, 'p' },
+        { "stats",   required_argument, 0, 'S' },
         { "yes",     no_argument,       0, 'y' },
         { "version", no_argument,       0, 'v' },
+        { "daemon",  no_argument,       0, 'D' },
 #ifdef GOLDEN_FLASH_SUPPORT
         { "alt-mtd", no_argument,       0, 'a' },
 #endif // GOLDEN_FLASH_SUPPORT
@@ -285,8 +472,12 @@ int main(int argc, char* argv[])
     bool skipSignCheck = false;
     bool skipMachineTypeCheck = false;
     bool forceFlash = false;
+    bool pipeline = false;
     bool doShowVersion = false;
+    bool runAsDaemon = false;
     std::string firmwareFile;
+    std::string statsFile;
+    std::vector<Operation> batch;
 #ifdef INTEL_C62X_SUPPORT
     bool doResetHostMacAddrs = false;
     std::string nvramReadFile;
@@ -296,7 +487,7 @@ int main(int argc, char* argv[])
     opterr = 0;
     int optVal;
     while ((optVal = getopt_long(argc, argv,
-                                 "hf:rsmFyv"
+                                 "hf:rsmFiV:pS:yvD"
 #ifdef GOLDEN_FLASH_SUPPORT
                                  "a"
 #endif // GOLDEN_FLASH_SUPPORT
@@ -317,10 +508,12 @@ int main(int argc, char* argv[])
 
             case 'f':
                 firmwareFile = optarg;
+                batch.push_back({optVal, optarg});
                 break;
 
             case 'r':
                 doReset = true;
+                batch.push_back({optVal, std::string()});
                 break;
 
             case 's':
@@ -335,6 +528,31 @@ int main(int argc, char* argv[])
                 forceFlash = true;
                 break;
 
+            case 'i':
+                FwUpdBase::flashOptions.incremental = true;
+                break;
+
+            case 'V':
+                try
+                {
+                    FwUpdBase::flashOptions.verify = getFlashVerify(optarg);
+                    verifyMode = optarg;
+                }
+                catch (const std::exception& err)
+                {
+                    fprintf(stderr, "%s\n", err.what());
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'p':
+                pipeline = true;
+                break;
+
+            case 'S':
+                statsFile = optarg;
+                break;
+
             case 'y':
                 interactive = false;
                 break;
@@ -343,6 +561,10 @@ int main(int argc, char* argv[])
                 doShowVersion = true;
                 break;
 
+            case 'D':
+                runAsDaemon = true;
+                break;
+
 #ifdef GOLDEN_FLASH_SUPPORT
             case 'a':
                 useGoldenFlash = true;
@@ -358,14 +580,17 @@ int main(int argc, char* argv[])
 
             case 'R':
                 doResetHostMacAddrs = true;
+                batch.push_back({optVal, std::string()});
                 break;
 
             case 'n':
                 nvramReadFile = optarg;
+                batch.push_back({optVal, optarg});
                 break;
 
             case 'w':
                 nvramWriteFile = optarg;
+                batch.push_back({optVal, optarg});
                 break;
 #endif // INTEL_C62X_SUPPORT
             default:
@@ -375,16 +600,66 @@ int main(int argc, char* argv[])
         }
     }
 
+    // Reset is the flag of the installation if any firmware file is given
+    if (!firmwareFile.empty())
+    {
+        batch.erase(std::remove_if(batch.begin(), batch.end(),
+                                   [](const auto& op) {
+                                       return op.option == 'r';
+                                   }),
+                    batch.end());
+    }
+    const bool doBatch = batch.size() > 1;
+
+    FILE* stats = nullptr;
+    if (!statsFile.empty())
+    {
+        stats = fopen(statsFile.c_str(), "ae");
+        if (!stats)
+        {
+            fprintf(stderr, "Unable to open %s: %s\n", statsFile.c_str(),
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        Tracer::setStatsFile(stats);
+    }
+
+    // The service always operates on the whole main flash drive and runs
+    // a single operation per request. The statistics are recorded by the
+    // process running the steps, so the request is kept local. Writing
+    // NVRAM and resetting the host MAC addresses are not provided by the
+    // service and always run locally.
+    useDaemon = !runAsDaemon && !doShowVersion && !doBatch && !stats;
+#ifdef GOLDEN_FLASH_SUPPORT
+    useDaemon = useDaemon && !useGoldenFlash;
+#endif // GOLDEN_FLASH_SUPPORT
+#ifdef INTEL_X722_SUPPORT
+    useDaemon = useDaemon && !BIOSUpdater::writeGbeOnly;
+#endif // INTEL_X722_SUPPORT
+
+    int rc = EXIT_SUCCESS;
     try
     {
-        if (doShowVersion)
+        useDaemon = useDaemon && isDaemonRunning();
+
+        if (runAsDaemon)
+        {
+            runDaemon();
+        }
+        else if (doShowVersion)
         {
             showVersion();
         }
+        else if (doBatch)
+        {
+            runBatch(batch, doReset && !firmwareFile.empty(), interactive,
+                     skipSignCheck, skipMachineTypeCheck, forceFlash,
+                     pipeline);
+        }
         else if (!firmwareFile.empty())
         {
             flashFirmware(firmwareFile, doReset, interactive, skipSignCheck,
-                          skipMachineTypeCheck, forceFlash);
+                          skipMachineTypeCheck, forceFlash, pipeline);
         }
         else if (doReset)
         {
@@ -393,15 +668,25 @@ int main(int argc, char* argv[])
 #ifdef INTEL_C62X_SUPPORT
         else if (doResetHostMacAddrs)
         {
-            BIOSUpdater::resetHostMacAddrs();
+            FwUpdate(forceFlash).resetHostMacAddrs();
         }
         else if (!nvramReadFile.empty())
         {
-            BIOSUpdater::readNvram(nvramReadFile);
+            if (useDaemon)
+            {
+                // The file is written with the permissions of the caller
+                std::vector<uint8_t> nvram;
+                callDaemon("ReadNvram", forceFlash).read(nvram);
+                FwUpdate::saveNvram(nvramReadFile, nvram);
+            }
+            else
+            {
+                FwUpdate(forceFlash).readNvram(nvramReadFile);
+            }
         }
         else if (!nvramWriteFile.empty())
         {
-            BIOSUpdater::writeNvram(nvramWriteFile);
+            FwUpdate(forceFlash).writeNvram(nvramWriteFile);
         }
 #endif
         else
@@ -411,14 +696,20 @@ int main(int argc, char* argv[])
                             "or one of --nvread/-nvwrite "
 #endif
                             "options must be specified!\n");
-            return EXIT_FAILURE;
+            rc = EXIT_FAILURE;
         }
     }
     catch (const std::exception& err)
     {
         fprintf(stderr, "%s\n", err.what());
-        return EXIT_FAILURE;
+        rc = EXIT_FAILURE;
+    }
+
+    if (stats)
+    {
+        Tracer::setStatsFile(nullptr);
+        fclose(stats);
     }
 
-    return EXIT_SUCCESS;
+    return rc;
 }
@@ -0,0 +1,160 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2020 YADRO.
+ */
+
+#pragma once
+
+#include "fwupderr.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+
+/**
+ * @brief RAII wrapper for memory mapped file.
+ */
+struct MappedMem
+{
+    MappedMem() = delete;
+    MappedMem(const MappedMem&) = delete;
+    MappedMem& operator=(const MappedMem&) = delete;
+
+    MappedMem(MappedMem&& other) :
+        addr(std::exchange(other.addr, nullptr)),
+        length(std::exchange(other.length, 0)), writable(other.writable)
+    {
+    }
+    MappedMem& operator=(MappedMem&& other)
+    {
+        if (this != &other)
+        {
+            unmap();
+            addr = std::exchange(other.addr, nullptr);
+            length = std::exchange(other.length, 0);
+            writable = other.writable;
+        }
+        return *this;
+    }
+
+    MappedMem(void* addr, size_t length, bool writable = false) :
+        addr(addr), length(length), writable(writable)
+    {
+    }
+    ~MappedMem()
+    {
+        unmap();
+    }
+
+    void* get() const
+    {
+        return addr;
+    }
+    size_t size() const
+    {
+        return length;
+    }
+    operator bool() const
+    {
+        return addr != nullptr;
+    }
+
+    /**
+     * @brief Process the mapped content sequentially by fixed size windows.
+     *        The kernel is asked to read ahead the next window while the
+     *        current one is processed, the processed windows of read-only
+     *        mapping are released, so the resident memory is bounded by
+     *        a few windows regardless of the file size.
+     *
+     * @param handler - function called as handler(const uint8_t*, size_t)
+     *                  for each window
+     * @param window  - size of the window, multiple of the page size
+     */
+    template <typename Handler>
+    void stream(Handler&& handler, size_t window = 1024 * 1024) const
+    {
+        const auto data = static_cast<uint8_t*>(addr);
+
+        // Hints are optional, errors are ignored
+        madvise(addr, length, MADV_SEQUENTIAL);
+        for (size_t pos = 0; pos < length; pos += window)
+        {
+            const size_t size = std::min(window, length - pos);
+            const size_t next = pos + size;
+            if (next < length)
+            {
+                madvise(data + next, std::min(window, length - next),
+                        MADV_WILLNEED);
+            }
+
+            handler(static_cast<const uint8_t*>(data + pos), size);
+
+            if (!writable)
+            {
+                // Clean pages are read again from the file if needed
+                madvise(data + pos, size, MADV_DONTNEED);
+            }
+        }
+    }
+
+    /**
+     * @brief Map specified file into memory
+     *
+     * @param filePath - path to file
+     * @param writable - flag to map private copy-on-write pages that can be
+     *                   modified in memory, the file itself is not changed
+     *
+     * @return MappedMem object with file content.
+     */
+    static MappedMem open(const std::string& filePath, bool writable = false)
+    {
+        int fd = ::open(filePath.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            throw FwupdateError("open %s failed, error=%d: %s",
+                                filePath.c_str(), errno, strerror(errno));
+        }
+
+        auto size = std::filesystem::file_size(filePath);
+        if (size == 0)
+        {
+            // Zero length mappings are not allowed
+            close(fd);
+            return MappedMem(nullptr, 0);
+        }
+
+        const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        auto addr = mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);
+        auto mmapErrNo = errno;
+        close(fd);
+
+        if (addr == MAP_FAILED)
+        {
+            throw FwupdateError("mmap for %s failed, error=%d: %s",
+                                filePath.c_str(), mmapErrNo,
+                                strerror(mmapErrNo));
+        }
+
+        return MappedMem(addr, size, writable);
+    }
+
+  private:
+    void unmap()
+    {
+        if (addr)
+        {
+            munmap(addr, length);
+        }
+    }
+
+    void* addr = nullptr;
+    size_t length = 0;
+    bool writable = false; //! Pages may be modified in memory
+};
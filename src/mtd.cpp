@@ -0,0 +1,120 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "mtd.hpp"
+
+#include "fwupderr.hpp"
+
+#include <fcntl.h>
+#include <mtd/mtd-user.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+MtdDevice::MtdDevice(const fs::path& device) :
+    device(device), fd(open(device.c_str(), O_RDWR | O_SYNC | O_CLOEXEC))
+{
+    if (fd == -1)
+    {
+        throw FwupdateError("open %s failed, error=%d: %s", device.c_str(),
+                            errno, strerror(errno));
+    }
+
+    mtd_info_t info;
+    if (ioctl(fd, MEMGETINFO, &info) == -1)
+    {
+        int err = errno;
+        close(fd);
+        throw FwupdateError("MEMGETINFO for %s failed, error=%d: %s",
+                            device.c_str(), err, strerror(err));
+    }
+
+    devSize = info.size;
+    blockSize = info.erasesize;
+    if (blockSize == 0)
+    {
+        close(fd);
+        throw FwupdateError("Invalid erase block size of %s", device.c_str());
+    }
+}
+
+MtdDevice::~MtdDevice()
+{
+    close(fd);
+}
+
+size_t MtdDevice::size() const
+{
+    return devSize;
+}
+
+size_t MtdDevice::eraseSize() const
+{
+    return blockSize;
+}
+
+void MtdDevice::erase(size_t offset, size_t length)
+{
+    if (offset % blockSize || length % blockSize || offset + length > devSize)
+    {
+        throw FwupdateError("Unaligned erase of %s: 0x%zx+0x%zx",
+                            device.c_str(), offset, length);
+    }
+
+    erase_info_t ei;
+    ei.start = static_cast<uint32_t>(offset);
+    ei.length = static_cast<uint32_t>(length);
+    if (ioctl(fd, MEMERASE, &ei) == -1)
+    {
+        throw FwupdateError("MEMERASE for %s at 0x%zx failed, error=%d: %s",
+                            device.c_str(), offset, errno, strerror(errno));
+    }
+}
+
+void MtdDevice::write(size_t offset, const void* data, size_t length)
+{
+    const auto* ptr = static_cast<const uint8_t*>(data);
+    while (length)
+    {
+        ssize_t rc = pwrite(fd, ptr, length, static_cast<off_t>(offset));
+        if (rc <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            throw FwupdateError("Write %s at 0x%zx failed, error=%d: %s",
+                                device.c_str(), offset, errno,
+                                strerror(errno));
+        }
+        ptr += rc;
+        offset += static_cast<size_t>(rc);
+        length -= static_cast<size_t>(rc);
+    }
+}
+
+void MtdDevice::read(size_t offset, void* data, size_t length)
+{
+    auto* ptr = static_cast<uint8_t*>(data);
+    while (length)
+    {
+        ssize_t rc = pread(fd, ptr, length, static_cast<off_t>(offset));
+        if (rc <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            throw FwupdateError("Read %s at 0x%zx failed, error=%d: %s",
+                                device.c_str(), offset, errno,
+                                strerror(errno));
+        }
+        ptr += rc;
+        offset += static_cast<size_t>(rc);
+        length -= static_cast<size_t>(rc);
+    }
+}
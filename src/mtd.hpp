@@ -0,0 +1,45 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include "flash.hpp"
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief MTD character device (/dev/mtdN).
+ */
+class MtdDevice : public FlashIFace
+{
+  public:
+    MtdDevice(const MtdDevice&) = delete;
+    MtdDevice& operator=(const MtdDevice&) = delete;
+
+    /**
+     * @brief Open MTD device and get its geometry.
+     *
+     * @param device - path to the MTD device, symlinks are allowed
+     *
+     * @throw FwupdateError in case of errors
+     */
+    MtdDevice(const fs::path& device);
+
+    ~MtdDevice();
+
+    size_t size() const override;
+    size_t eraseSize() const override;
+    void erase(size_t offset, size_t length) override;
+    void write(size_t offset, const void* data, size_t length) override;
+    void read(size_t offset, void* data, size_t length) override;
+
+  private:
+    fs::path device;      //! Path to the device
+    int fd = -1;          //! Device file descriptor
+    size_t devSize = 0;   //! Total size of the device
+    size_t blockSize = 0; //! Erase block size
+};
@@ -12,7 +12,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
 #include <system_error>
+#include <utility>
 
 NvmX722::NvmX722(const std::filesystem::path& file)
 {
@@ -43,24 +46,7 @@ NvmX722::NvmX722(const std::filesystem::path& file)
             throw std::system_error(errno, std::generic_category());
         }
 
-        // check min size
-        if (size < nvmSize)
-        {
-            throw std::runtime_error("The image file is too small to contain a 10GBE region");
-        }
-
-        // move start offset if input file is a BIOS image
-        start = (size == nvmSize) ? 0 : nvmOffset;
-
-        // search for valid bank
-        if (readWord(controlWord) != bankValid)
-        {
-            start += bankSize;
-            if (readWord(controlWord) != bankValid)
-            {
-                throw std::runtime_error("No valid bank in 10GBE");
-            }
-        }
+        findBank();
     }
     catch (...)
     {
@@ -76,29 +62,71 @@ NvmX722::NvmX722(const std::filesystem::path& file)
     }
 
     close(fd);
+    mapped = true;
+}
+
+NvmX722::NvmX722(void* data, size_t size) : data(data), size(size)
+{
+    findBank();
 }
 
 NvmX722::~NvmX722()
 {
-    munmap(data, size);
+    if (mapped)
+    {
+        munmap(data, size);
+    }
+}
+
+void NvmX722::findBank()
+{
+    // check min size
+    if (size < nvmSize)
+    {
+        throw std::runtime_error("The image file is too small to contain a 10GBE region");
+    }
+
+    // move start offset if input file is a BIOS image
+    start = (size == nvmSize) ? 0 : nvmOffset;
+
+    // search for valid bank
+    if (readWord(controlWord) != bankValid)
+    {
+        start += bankSize;
+        if (readWord(controlWord) != bankValid)
+        {
+            throw std::runtime_error("No valid bank in 10GBE");
+        }
+    }
+
+    // the bank must contain the whole checksum range
+    wordPtr(0, bankSize - pcieAltSize);
+
+    // get offset for MAC settings, the header precedes each address
+    macOffset = readWord(magicOffset1);
+    macOffset += magicOffset2;
+    macOffset += readWord(macOffset);
+    wordPtr(macOffset,
+            maxMac * (macHeaderSize * sizeof(word_t) + sizeof(mac_t)));
+}
+
+uint8_t* NvmX722::macPtr(size_t index) const
+{
+    constexpr size_t macWords = sizeof(mac_t) / sizeof(word_t);
+    const size_t offset =
+        macOffset + macHeaderSize + index * (macHeaderSize + macWords);
+    return reinterpret_cast<uint8_t*>(data) + start + offset * sizeof(word_t);
 }
 
 NvmX722::MacAddresses NvmX722::getMac() const
 {
     MacAddresses mac;
 
-    // get offset for MAC settings
-    word_t offset = readWord(magicOffset1);
-    offset += magicOffset2;
-    offset += readWord(offset);
-
     // read PF MAC addresses
     for (size_t i = 0; i < mac.size(); ++i)
     {
-        offset += macHeaderSize;
-        const uint8_t* macPtr = wordPtr(offset, sizeof(mac_t));
-        std::copy(macPtr, macPtr + sizeof(mac_t), mac[i]);
-        offset += sizeof(mac_t) / sizeof(word_t);
+        const uint8_t* ptr = macPtr(i);
+        std::copy(ptr, ptr + sizeof(mac_t), mac[i]);
     }
 
     return mac;
@@ -106,18 +134,10 @@ NvmX722::MacAddresses NvmX722::getMac() const
 
 void NvmX722::setMac(const MacAddresses& mac)
 {
-    // get offset for MAC settings
-    word_t offset = readWord(magicOffset1);
-    offset += magicOffset2;
-    offset += readWord(offset);
-
     // write PF MAC addresses
     for (size_t i = 0; i < mac.size(); ++i)
     {
-        offset += macHeaderSize;
-        uint8_t* macPtr = wordPtr(offset, sizeof(mac_t));
-        std::copy(mac[i], mac[i] + sizeof(mac_t), macPtr);
-        offset += sizeof(mac_t) / sizeof(word_t);
+        std::copy(mac[i], mac[i] + sizeof(mac_t), macPtr(i));
     }
 
     // update checksum
@@ -125,7 +145,7 @@ void NvmX722::setMac(const MacAddresses& mac)
     *reinterpret_cast<word_t*>(chkSumPtr) = calcChecksum();
 
     // write changes to persistent storage
-    if (msync(data, size, MS_SYNC) == -1)
+    if (mapped && msync(data, size, MS_SYNC) == -1)
     {
         throw std::system_error(errno, std::generic_category());
     }
@@ -147,29 +167,76 @@ NvmX722::word_t NvmX722::readWord(word_t offset) const
     return *reinterpret_cast<const word_t*>(ptr);
 }
 
-NvmX722::word_t NvmX722::calcChecksum() const
+/**
+ * @brief Sum the words of the range.
+ *        The words are summed in blocks of fixed size without branches, so
+ *        the inner loop is vectorized by the compiler. The sum is accumulated
+ *        in wide integer and truncated by the caller.
+ *
+ * @param[in] data pointer to the first word
+ * @param[in] count number of words
+ *
+ * @return sum of the words
+ */
+static uint32_t sumWords(const uint8_t* data, size_t count)
 {
-    word_t chkSum = 0;
-    const word_t vpdStart = readWord(vpdOffset);
+    using word_t = NvmX722::word_t;
+    constexpr size_t blockWords = 64;
 
-    for (word_t i = 0; i < bankSize / sizeof(word_t); ++i)
+    uint32_t sum = 0;
+    size_t pos = 0;
+    for (; pos + blockWords <= count; pos += blockWords)
     {
-        if (i == checksumOffset)
+        word_t block[blockWords];
+        memcpy(block, data + pos * sizeof(word_t), sizeof(block));
+        for (size_t i = 0; i < blockWords; ++i)
         {
-            continue; // skip checksum word
+            sum += block[i];
         }
-        if (i >= vpdStart && i < vpdStart + vpdSize / sizeof(word_t))
-        {
-            continue; // skip VPD module
-        }
-        if (i >= (bankSize - pcieAltSize) / sizeof(word_t))
+    }
+    for (; pos < count; ++pos)
+    {
+        word_t word;
+        memcpy(&word, data + pos * sizeof(word_t), sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+NvmX722::word_t NvmX722::calcChecksum() const
+{
+    // PCIe ALT module resides at the end of bank and is not covered
+    const size_t endWord = (bankSize - pcieAltSize) / sizeof(word_t);
+    const uint8_t* bank = wordPtr(0, endWord * sizeof(word_t));
+
+    // skip checksum word and VPD module
+    const size_t vpdStart = readWord(vpdOffset);
+    std::pair<size_t, size_t> holes[] = {
+        {checksumOffset, checksumOffset + 1},
+        {vpdStart, vpdStart + vpdSize / sizeof(word_t)},
+    };
+    if (holes[1].first < holes[0].first)
+    {
+        std::swap(holes[0], holes[1]);
+    }
+
+    uint32_t chkSum = 0;
+    size_t pos = 0;
+    for (const auto& [from, to] : holes)
+    {
+        const size_t end = std::min(from, endWord);
+        if (pos < end)
         {
-            break; // skip PCIe ALT module (it resides at the end of bank)
+            chkSum += sumWords(bank + pos * sizeof(word_t), end - pos);
         }
-        chkSum += readWord(i);
+        pos = std::max(pos, to);
+    }
+    if (pos < endWord)
+    {
+        chkSum += sumWords(bank + pos * sizeof(word_t), endWord - pos);
     }
 
-    return checksumBase - chkSum;
+    return checksumBase - static_cast<word_t>(chkSum);
 }
 
 /**
@@ -250,41 +317,6 @@ struct BoardInfo
 } __attribute__((packed));
 
 using Property = std::variant<std::string>;
-using Properties = std::map<PropertyName, Property>;
-/**
- * @brief Get all D-Bus properties from the specified service.
- *
- * NOTE: We don't put this method into the generic dbus.hpp header because as of
- *       now it only supports `string` properties and is not fully usable as a
- *       generic method
- *
- * @param busname - D-Bus service name
- * @param path    - Object path
- * @param iface   - Poperties interface
- *
- * @return Map of propety' names and values.
- *
- * @throw FwupdateError if case of error
- */
-Properties getAllProperties(const BusName& busname, const Path& path,
-                            const Interface& iface)
-{
-    auto req = systemBus.new_method_call(
-        busname.c_str(), path.c_str(), SYSTEMD_PROPERTIES_INTERFACE, "GetAll");
-    req.append(iface);
-    Properties props;
-
-    try
-    {
-        systemBus.call(req).read(props);
-    }
-    catch (const sdbusplus::exception::SdBusError& e)
-    {
-        throw FwupdateError("Get all properties call failed: %s", e.what());
-    }
-
-    return props;
-}
 
 NvmX722::MacAddresses NvmX722::getMacFromFRU()
 {
@@ -293,40 +325,56 @@ NvmX722::MacAddresses NvmX722::getMacFromFRU()
     static const char* fruDevicePath = "/xyz/openbmc_project/FruDevice";
     static const char* fruDeviceIface = "xyz.openbmc_project.FruDevice";
 
-    auto objects = getSubTree(fruDevicePath, {fruDeviceIface});
-    for (const auto& [path, services] : objects)
+    // Properties of all motherboard FRU devices are requested at once
+    std::vector<PropertiesQuery> queries;
+    for (const auto& [path, services] :
+         getSubTree(fruDevicePath, {fruDeviceIface}))
     {
         if (!std::equal(mboard.crbegin(), mboard.crend(), path.crbegin()))
         {
             continue;
         }
-
         for (const auto& [service, _] : services)
         {
-            auto properties = getAllProperties(service, path, fruDeviceIface);
-            MacAddresses mac{0};
-            for (const auto& [name, value] : properties)
+            queries.push_back({service, path, fruDeviceIface});
+        }
+    }
+    if (queries.empty())
+    {
+        throw FwupdateError("No properly records found in FRU");
+    }
+
+    auto allProperties = getAllProperties<Property>(queries);
+    for (const auto& properties : allProperties)
+    {
+        if (properties.empty())
+        {
+            // GetAll call failed
+            continue;
+        }
+
+        MacAddresses mac{0};
+        for (const auto& [name, value] : properties)
+        {
+            if (!std::equal(boardInfoAm.cbegin(), boardInfoAm.cend(),
+                            name.cbegin()))
             {
-                if (!std::equal(boardInfoAm.cbegin(), boardInfoAm.cend(),
-                                name.cbegin()))
-                {
-                    continue;
-                }
+                continue;
+            }
 
-                auto bi = BoardInfo::fromString(std::get<std::string>(value));
-                if (bi.recordType == BoardInfo::macAddressType &&
-                    bi.designation() == BoardInfo::x722MacAddr)
+            auto bi = BoardInfo::fromString(std::get<std::string>(value));
+            if (bi.recordType == BoardInfo::macAddressType &&
+                bi.designation() == BoardInfo::x722MacAddr)
+            {
+                if (bi.index() >= mac.size())
                 {
-                    if (bi.index() >= mac.size())
-                    {
-                        throw FwupdateError("Invalid MAC index in FRU");
-                    }
-                    std::swap(mac[bi.index()], bi.mac);
+                    throw FwupdateError("Invalid MAC index in FRU");
                 }
+                std::swap(mac[bi.index()], bi.mac);
             }
-
-            return mac;
         }
+
+        return mac;
     }
 
     throw FwupdateError("No properly records found in FRU");
@@ -44,6 +44,16 @@ class NvmX722
      */
     NvmX722(const std::filesystem::path& file);
 
+    /**
+     * @brief Constructor: use the image in memory, the data is not copied.
+     *
+     * @param[in] data Pointer to the image (10GBE or BIOS image)
+     * @param[in] size Size of the image in bytes
+     *
+     * @throw std::exception in case of errors
+     */
+    NvmX722(void* data, size_t size);
+
     /** @brief Destructor. */
     ~NvmX722();
 
@@ -75,6 +85,23 @@ class NvmX722
     void setMac(const MacAddresses& mac);
 
   private:
+    /**
+     * @brief Check image size, search for valid bank and locate the MAC
+     *        addresses.
+     *
+     * @throw std::exception in case of errors
+     */
+    void findBank();
+
+    /**
+     * @brief Get pointer to the PF MAC address.
+     *
+     * @param[in] index MAC address index
+     *
+     * @return pointer to the MAC address
+     */
+    uint8_t* macPtr(size_t index) const;
+
     /**
      * @brief Get data pointer for specified word offset.
      *
@@ -104,7 +131,9 @@ class NvmX722
     word_t calcChecksum() const;
 
   private:
-    void* data;   ///< Pointer to the file data
-    size_t size;  ///< Size of file data in bytes
-    size_t start; ///< Offset to the valid block of NVM
+    void* data;          ///< Pointer to the file data
+    size_t size;         ///< Size of file data in bytes
+    size_t start;        ///< Offset to the valid block of NVM
+    word_t macOffset;    ///< Word offset of the PF MAC addresses
+    bool mapped = false; ///< Flag that data is mapped from the file
 };
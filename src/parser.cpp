@@ -0,0 +1,91 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "parser.hpp"
+
+#include <fstream>
+#include <iterator>
+
+bool isWord(std::string_view str)
+{
+    if (str.empty())
+    {
+        return false;
+    }
+    for (const char c : str)
+    {
+        if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') &&
+            !(c >= '0' && c <= '9') && c != '_')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view str)
+{
+    size_t start = 0;
+    while (start < str.size() && isSpace(str[start]))
+    {
+        ++start;
+    }
+    size_t end = str.size();
+    while (end > start && isSpace(str[end - 1]))
+    {
+        --end;
+    }
+    return str.substr(start, end - start);
+}
+
+Config::Config(std::string_view content)
+{
+    while (!content.empty())
+    {
+        const size_t eol = content.find('\n');
+        const std::string_view line = content.substr(0, eol);
+        content.remove_prefix(eol == std::string_view::npos ? content.size()
+                                                            : eol + 1);
+
+        const size_t eq = line.find('=');
+        if (eq == std::string_view::npos)
+        {
+            continue;
+        }
+        const std::string_view key = trim(line.substr(0, eq));
+        std::string_view value = trim(line.substr(eq + 1));
+
+        // The value may be quoted
+        if (!value.empty() && value.front() == '"')
+        {
+            value.remove_prefix(1);
+        }
+        if (!value.empty() && value.back() == '"')
+        {
+            value.remove_suffix(1);
+        }
+
+        if (isWord(key) && !value.empty() &&
+            value.find('"') == std::string_view::npos)
+        {
+            values.emplace(key, value);
+        }
+    }
+}
+
+Config Config::load(const fs::path& file)
+{
+    std::ifstream in(file, std::ios::binary);
+    const std::string content((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    return Config(content);
+}
+
+const std::string& Config::get(std::string_view key) const
+{
+    static const std::string empty;
+    auto it = values.find(key);
+    return it == values.end() ? empty : it->second;
+}
@@ -0,0 +1,130 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include <array>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Check if the name is listed in the table.
+ *
+ * @param name  - name to check
+ * @param names - table of the names
+ *
+ * @return true if the name is found
+ */
+template <size_t N>
+constexpr bool isOneOf(std::string_view name,
+                       const std::array<std::string_view, N>& names)
+{
+    for (const auto& it : names)
+    {
+        if (it == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Check if the character is a white space.
+ */
+constexpr bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+           c == '\f';
+}
+
+/**
+ * @brief Check if the string is not empty and contains only the word
+ *        characters: letters, digits and underscores.
+ */
+bool isWord(std::string_view str);
+
+/**
+ * @brief Remove leading and trailing white spaces.
+ */
+std::string_view trim(std::string_view str);
+
+/**
+ * @brief Split the line to the fields separated by white spaces.
+ *
+ * @param line   - line to split
+ * @param fields - array to fill with the first fields of the line
+ *
+ * @return Number of the fields found, not more than the array size
+ */
+template <size_t N>
+size_t splitFields(std::string_view line,
+                   std::array<std::string_view, N>& fields)
+{
+    size_t count = 0;
+    size_t pos = 0;
+    while (count < N)
+    {
+        while (pos < line.size() && isSpace(line[pos]))
+        {
+            ++pos;
+        }
+        if (pos == line.size())
+        {
+            break;
+        }
+        const size_t start = pos;
+        while (pos < line.size() && !isSpace(line[pos]))
+        {
+            ++pos;
+        }
+        fields[count++] = line.substr(start, pos - start);
+    }
+    return count;
+}
+
+/**
+ * @brief Key-value pairs of the config file, such as MANIFEST or
+ *        os-release. Each line of the file is `KEY=value` or `KEY="value"`,
+ *        other lines are ignored. The first occurrence of the key is used.
+ */
+class Config
+{
+  public:
+    Config() = default;
+
+    /**
+     * @brief Parse the config content.
+     *
+     * @param content - text of the config
+     */
+    explicit Config(std::string_view content);
+
+    /**
+     * @brief Load the config file in a single pass.
+     *
+     * @param file - path to the config file
+     *
+     * @return All the key-value pairs, empty if the file is not readable
+     */
+    static Config load(const fs::path& file);
+
+    /**
+     * @brief Get value of the key.
+     *
+     * @param key - the key name
+     *
+     * @return Value of the key, empty string if the key is not found
+     */
+    const std::string& get(std::string_view key) const;
+
+  private:
+    std::map<std::string, std::string, std::less<>> values; //! Key -> value
+};
@@ -0,0 +1,213 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "pnor.hpp"
+
+#include "fwupderr.hpp"
+#include "tracer.hpp"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr uint32_t ffsMagic = 0x50415254; // "PART"
+static constexpr uint32_t ffsVersion = 1;
+
+// Data integrity flags of the partition
+static constexpr uint16_t ffsIntegEcc = 0x8000;
+// Miscellaneous flags of the partition
+static constexpr uint8_t ffsMiscPreserved = 0x80;
+static constexpr uint8_t ffsMiscReadonly = 0x40;
+static constexpr uint8_t ffsMiscReprovision = 0x10;
+
+/**
+ * @brief FFS table header, all fields are big endian.
+ */
+struct FfsHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // Size of the table in blocks
+    uint32_t entrySize;
+    uint32_t entryCount;
+    uint32_t blockSize;
+    uint32_t blockCount;
+    uint32_t reserved[4];
+    uint32_t checksum;
+};
+static_assert(sizeof(FfsHeader) == 48, "Invalid FFS header size");
+
+/**
+ * @brief FFS partition entry, all fields are big endian.
+ */
+struct FfsEntry
+{
+    char name[16];
+    uint32_t base; // Offset in blocks
+    uint32_t size; // Size in blocks
+    uint32_t pid;
+    uint32_t id;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t actual; // Size of the content in bytes
+    uint32_t reserved[4];
+    struct
+    {
+        uint8_t chip;
+        uint8_t compressType;
+        uint16_t dataInteg;
+        uint8_t verCheck;
+        uint8_t miscFlags;
+        uint8_t freeMisc[2];
+        uint32_t reserved[14];
+    } user;
+    uint32_t checksum;
+};
+static_assert(sizeof(FfsEntry) == 128, "Invalid FFS entry size");
+
+/**
+ * @brief Check the FFS checksum: XOR of all the words including the checksum
+ *        field is zero.
+ */
+template <typename T>
+static bool isChecksumValid(const T& object)
+{
+    uint32_t words[sizeof(T) / sizeof(uint32_t)];
+    memcpy(words, &object, sizeof(words));
+
+    uint32_t sum = 0;
+    for (const auto word : words)
+    {
+        sum ^= word;
+    }
+    return sum == 0;
+}
+
+PnorToc::PnorToc(const uint8_t* data, size_t size)
+{
+    FfsHeader hdr;
+    if (size < sizeof(hdr))
+    {
+        throw FwupdateError("PNOR partition table is truncated");
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+
+    if (be32toh(hdr.magic) != ffsMagic || be32toh(hdr.version) != ffsVersion)
+    {
+        throw FwupdateError("PNOR partition table not found");
+    }
+    if (!isChecksumValid(hdr))
+    {
+        throw FwupdateError("PNOR partition table header is corrupted");
+    }
+
+    const size_t entrySize = be32toh(hdr.entrySize);
+    const size_t entryCount = be32toh(hdr.entryCount);
+    const size_t blockSize = be32toh(hdr.blockSize);
+    const size_t flashSize = blockSize * be32toh(hdr.blockCount);
+    if (entrySize != sizeof(FfsEntry) || blockSize == 0 ||
+        entryCount > (size - sizeof(hdr)) / entrySize)
+    {
+        throw FwupdateError("Invalid PNOR partition table geometry");
+    }
+
+    parts.reserve(entryCount);
+    const uint8_t* ptr = data + sizeof(hdr);
+    for (size_t i = 0; i < entryCount; ++i, ptr += sizeof(FfsEntry))
+    {
+        FfsEntry entry;
+        memcpy(&entry, ptr, sizeof(entry));
+        if (!isChecksumValid(entry))
+        {
+            throw FwupdateError("PNOR partition table entry %zu is corrupted",
+                                i);
+        }
+
+        PnorPartition part;
+        part.name.assign(entry.name, strnlen(entry.name, sizeof(entry.name)));
+        part.id = be32toh(entry.id);
+        part.offset = blockSize * be32toh(entry.base);
+        part.size = blockSize * be32toh(entry.size);
+        part.actual = be32toh(entry.actual);
+        part.ecc = be16toh(entry.user.dataInteg) & ffsIntegEcc;
+        part.preserved = entry.user.miscFlags & ffsMiscPreserved;
+        part.readonly = entry.user.miscFlags & ffsMiscReadonly;
+        part.reprovision = entry.user.miscFlags & ffsMiscReprovision;
+
+        if (part.offset > flashSize || part.size > flashSize - part.offset)
+        {
+            throw FwupdateError("PNOR partition %s is out of the flash",
+                                part.name.c_str());
+        }
+
+        parts.emplace_back(std::move(part));
+    }
+}
+
+PnorToc PnorToc::read(FlashIFace& flash)
+{
+    FfsHeader hdr;
+    flash.read(0, &hdr, sizeof(hdr));
+
+    // The header is fully validated by the parser
+    const size_t entryCount = be32toh(hdr.entryCount);
+    if (be32toh(hdr.magic) != ffsMagic ||
+        entryCount > (flash.size() - sizeof(hdr)) / sizeof(FfsEntry))
+    {
+        throw FwupdateError("PNOR partition table not found");
+    }
+
+    std::vector<uint8_t> toc(sizeof(hdr) + entryCount * sizeof(FfsEntry));
+    flash.read(0, toc.data(), toc.size());
+
+    return PnorToc(toc.data(), toc.size());
+}
+
+const PnorPartition* PnorToc::find(const std::string& name) const
+{
+    auto it = std::find_if(parts.begin(), parts.end(),
+                           [&name](const auto& p) { return p.name == name; });
+    return it == parts.end() ? nullptr : &*it;
+}
+
+void clearPartitions(FlashIFace& flash,
+                     const std::vector<PnorPartition>& partitions,
+                     const FlashOptions& options)
+{
+    std::vector<const PnorPartition*> sorted;
+    for (const auto& part : partitions)
+    {
+        sorted.emplace_back(&part);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](auto a, auto b) { return a->offset < b->offset; });
+
+    auto it = sorted.begin();
+    while (it != sorted.end())
+    {
+        // Join the adjacent partitions of the same kind
+        const bool ecc = (*it)->ecc;
+        const size_t start = (*it)->offset;
+        size_t end = start + (*it)->size;
+        std::string names = (*it)->name;
+        while (++it != sorted.end() && (*it)->ecc == ecc &&
+               (*it)->offset == end)
+        {
+            end += (*it)->size;
+            names += ", ";
+            names += (*it)->name;
+        }
+
+        Tracer tracer("Clear %s partition [%s]", names.c_str(),
+                      ecc ? "ECC" : "Erase");
+
+        // Zero filled data has zero ECC bytes
+        const std::vector<uint8_t> fill(end - start, ecc ? 0x00 : 0xff);
+        writeRegion(flash, start, fill.data(), fill.size(), options, tracer);
+
+        tracer.done();
+    }
+}
@@ -0,0 +1,91 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include "flash.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Partition of the PNOR flash.
+ */
+struct PnorPartition
+{
+    std::string name; //! Partition name
+    uint32_t id;      //! Partition id
+    size_t offset;    //! Offset of the partition in bytes
+    size_t size;      //! Size of the partition in bytes
+    size_t actual;    //! Size of the partition content in bytes
+    bool ecc;         //! Partition content is protected by ECC
+    bool preserved;   //! Partition content is preserved on update
+    bool readonly;    //! Partition is read only
+    bool reprovision; //! Partition is cleared on reset to defaults
+};
+
+/**
+ * @brief Table of contents of the PNOR flash in FFS format.
+ */
+class PnorToc
+{
+  public:
+    /**
+     * @brief Parse the table of contents.
+     *
+     * @param data - image data starting with the table
+     * @param size - size of the image data
+     *
+     * @throw FwupdateError if the table is invalid
+     */
+    PnorToc(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Read the table of contents from the start of the flash drive.
+     *
+     * @param flash - PNOR flash drive
+     *
+     * @throw FwupdateError in case of errors
+     */
+    static PnorToc read(FlashIFace& flash);
+
+    /**
+     * @brief Get the partitions in order of the table entries.
+     */
+    const std::vector<PnorPartition>& partitions() const
+    {
+        return parts;
+    }
+
+    /**
+     * @brief Find the partition by name.
+     *
+     * @param name - partition name
+     *
+     * @return Pointer to the partition or nullptr if not found
+     */
+    const PnorPartition* find(const std::string& name) const;
+
+  private:
+    std::vector<PnorPartition> parts; //! Partitions of the flash
+};
+
+/**
+ * @brief Clear the partitions of the PNOR flash in one pass.
+ *        Partitions without ECC are erased, partitions with ECC are filled
+ *        with zeros that have the valid ECC. Adjacent partitions of the same
+ *        kind are written as a single region.
+ *
+ * @param flash      - PNOR flash drive
+ * @param partitions - partitions to clear
+ * @param options    - write options
+ *
+ * @throw FwupdateError in case of errors
+ */
+void clearPartitions(FlashIFace& flash,
+                     const std::vector<PnorPartition>& partitions,
+                     const FlashOptions& options);
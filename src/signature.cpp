@@ -8,113 +8,305 @@
 #include "signature.hpp"
 
 #include "fwupderr.hpp"
+#include "mappedmem.hpp"
 
-#include <fcntl.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/objects.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
-#include <sys/mman.h>
+
+#ifdef KERNEL_CRYPTO_SUPPORT
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#endif // KERNEL_CRYPTO_SUPPORT
 
+#include <algorithm>
+#include <cctype>
 #include <cerrno>
 #include <cstring>
 #include <filesystem>
+#include <map>
+#include <mutex>
 
 namespace fs = std::filesystem;
 
 // RAII support for openssl functions.
 using BIO_MEM_Ptr = std::unique_ptr<BIO, decltype(&::BIO_free)>;
-using EVP_PKEY_Ptr = std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)>;
 using EVP_MD_CTX_Ptr =
     std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
+using EVP_PKEY_CTX_Ptr =
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)>;
+
+// Digests calculated in advance: file path -> {hash function, digest}
+static std::map<std::string, std::pair<std::string, DigestValue>> digests;
+static std::mutex digestsMutex;
+
+KeyRing::KeyRing()
+{
+    // Adds all digest algorithms to the internal table
+    OpenSSL_add_all_digests();
+}
+
+KeyRing& KeyRing::instance()
+{
+    static KeyRing keyRing;
+    return keyRing;
+}
+
+KeyRing::Key KeyRing::getKey(const std::string& keyFile)
+{
+    auto data = MappedMem::open(keyFile);
+    std::string pem(static_cast<const char*>(data.get()), data.size());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = keys.find(pem);
+    if (it != keys.end())
+    {
+        return it->second;
+    }
+
+    BIO_MEM_Ptr keyBio(BIO_new_mem_buf(pem.data(), pem.size()), &::BIO_free);
+    if (!keyBio)
+    {
+        throw FwupdateError("Failed to create new BIO Memory buffer.");
+    }
+
+    Key key(PEM_read_bio_PUBKEY(keyBio.get(), nullptr, nullptr, nullptr),
+            &::EVP_PKEY_free);
+    if (!key)
+    {
+        throw FwupdateError("Failed to create public key object.");
+    }
+
+    keys.emplace(std::move(pem), key);
+    return key;
+}
+
+const EVP_MD* KeyRing::getDigest(const std::string& hashFunc)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = mds.find(hashFunc);
+    if (it != mds.end())
+    {
+        return it->second;
+    }
+
+    // Create Hash structure.
+    auto hashStruct = EVP_get_digestbyname(hashFunc.c_str());
+    if (!hashStruct)
+    {
+        throw FwupdateError("EVP_get_digestbyname: Unknown message digest.");
+    }
+
+    mds.emplace(hashFunc, hashStruct);
+    return hashStruct;
+}
 
 /**
- * @brief RAII wrapper for memory mapped file.
+ * @brief Verify signature of the precalculated digest.
+ *
+ * @param publicKey  - key object
+ * @param hashStruct - message digest structure
+ * @param digest     - digest value
+ * @param signature  - mapped signature file
+ *
+ * @return true if signature is valid
  */
-struct MappedMem
+static bool verifyDigest(EVP_PKEY* publicKey, const EVP_MD* hashStruct,
+                         const DigestValue& digest, const MappedMem& signature)
 {
-    MappedMem() = delete;
-    MappedMem(const MappedMem&) = delete;
-    MappedMem& operator=(const MappedMem&) = delete;
-    MappedMem(MappedMem&&) = default;
-    MappedMem& operator=(MappedMem&&) = default;
-
-    MappedMem(void* addr, size_t length) : addr(addr), length(length)
+    EVP_PKEY_CTX_Ptr verifyCtx(EVP_PKEY_CTX_new(publicKey, nullptr),
+                               &::EVP_PKEY_CTX_free);
+    if (!verifyCtx)
     {
+        throw FwupdateError("Failed to create public key context.");
     }
-    ~MappedMem()
+
+    if (EVP_PKEY_verify_init(verifyCtx.get()) != 1 ||
+        EVP_PKEY_CTX_set_signature_md(verifyCtx.get(), hashStruct) != 1)
     {
-        munmap(addr, length);
+        throw FwupdateError("Error %lu occurred during EVP_PKEY_verify_init.",
+                            ERR_get_error());
     }
 
-    void* get() const
+    auto result = EVP_PKEY_verify(
+        verifyCtx.get(), reinterpret_cast<unsigned char*>(signature.get()),
+        signature.size(), digest.data(), digest.size());
+    if (result < 0)
     {
-        return addr;
+        throw FwupdateError("Error %lu occurred during EVP_PKEY_verify.",
+                            ERR_get_error());
     }
-    size_t size() const
+
+    return result == 1;
+}
+
+Digest::Digest(const std::string& hashFunc) :
+    ctx(EVP_MD_CTX_new(), &::EVP_MD_CTX_free)
+{
+    if (!ctx || EVP_DigestInit_ex(ctx.get(),
+                                  KeyRing::instance().getDigest(hashFunc),
+                                  nullptr) != 1)
     {
-        return length;
+        throw FwupdateError("Error %lu occurred during EVP_DigestInit.",
+                            ERR_get_error());
     }
-    operator bool() const
+}
+
+void Digest::update(const void* data, size_t size)
+{
+    if (EVP_DigestUpdate(ctx.get(), data, size) != 1)
     {
-        return addr != nullptr;
+        throw FwupdateError("Error %lu occurred during EVP_DigestUpdate.",
+                            ERR_get_error());
     }
+}
 
-    /**
-     * @brief Map specified file into memory
-     *
-     * @param filePath - path to file
-     *
-     * @return MappedMem object with file content.
-     */
-    static MappedMem open(const std::string& filePath)
+DigestValue Digest::final()
+{
+    DigestValue digest(EVP_MAX_MD_SIZE);
+    unsigned int size = 0;
+    if (EVP_DigestFinal_ex(ctx.get(), digest.data(), &size) != 1)
     {
-        int fd = ::open(filePath.c_str(), O_RDONLY);
-        if (fd == -1)
-        {
-            throw FwupdateError("open %s failed, error=%d: %s",
-                                filePath.c_str(), errno, strerror(errno));
-        }
+        throw FwupdateError("Error %lu occurred during EVP_DigestFinal.",
+                            ERR_get_error());
+    }
+    digest.resize(size);
+    return digest;
+}
 
-        auto size = fs::file_size(filePath);
-        auto addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
-        auto mmapErrNo = errno;
-        close(fd);
+#ifdef KERNEL_CRYPTO_SUPPORT
+/**
+ * @brief File descriptor closed on scope exit.
+ */
+struct FileDesc
+{
+    FileDesc(int fd) : fd(fd)
+    {}
 
-        if (addr == MAP_FAILED)
+    FileDesc(const FileDesc&) = delete;
+    FileDesc& operator=(const FileDesc&) = delete;
+
+    ~FileDesc()
+    {
+        if (fd != -1)
         {
-            throw FwupdateError("mmap for %s failed, error=%d: %s",
-                                filePath.c_str(), mmapErrNo,
-                                strerror(mmapErrNo));
+            close(fd);
         }
-
-        return MappedMem(addr, size);
     }
 
-  private:
-    void* addr = nullptr;
-    size_t length = 0;
+    int fd;
 };
 
 /**
- * @brief Create key object from the public key file.
+ * @brief Calculate the file digest by the kernel crypto API.
+ *        The file pages are spliced to the hash socket through a pipe, so
+ *        the data isn't copied to user space, and the hash is calculated by
+ *        the best kernel implementation, e.g. by the hardware engine.
  *
- * @param publicKey - path to public key file
+ * @param hashStruct - hash function
+ * @param filePath   - path to the file
  *
- * @return Key object
+ * @return Digest value, empty if the kernel can't calculate it
  */
-EVP_PKEY_Ptr createPublicKey(const std::string& publicKey)
+static DigestValue kernelDigest(const EVP_MD* hashStruct,
+                                const std::string& filePath)
 {
-    auto data = MappedMem::open(publicKey);
-    BIO_MEM_Ptr keyBio(BIO_new_mem_buf(data.get(), data.size()), &::BIO_free);
-    if (!keyBio)
+    constexpr int pipeSize = 1024 * 1024;
+
+    // The manifest may name the hash by an alias (e.g. RSA-SHA256), the
+    // short name of the resolved digest matches the kernel one (sha256)
+    const char* hashName = OBJ_nid2sn(EVP_MD_type(hashStruct));
+    sockaddr_alg sa{};
+    sa.salg_family = AF_ALG;
+    strcpy(reinterpret_cast<char*>(sa.salg_type), "hash");
+    if (!hashName || strlen(hashName) >= sizeof(sa.salg_name))
     {
-        throw FwupdateError("Failed to create new BIO Memory buffer.");
+        return {};
+    }
+    // Kernel uses lower case names of the hash functions
+    std::transform(hashName, hashName + strlen(hashName), sa.salg_name,
+                   [](unsigned char c) { return std::tolower(c); });
+
+    FileDesc alg(socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+    if (alg.fd == -1 ||
+        bind(alg.fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) == -1)
+    {
+        return {};
+    }
+    FileDesc op(accept4(alg.fd, nullptr, nullptr, SOCK_CLOEXEC));
+    FileDesc file(open(filePath.c_str(), O_RDONLY | O_CLOEXEC));
+    int pipeFds[2];
+    if (op.fd == -1 || file.fd == -1 || pipe2(pipeFds, O_CLOEXEC) == -1)
+    {
+        return {};
+    }
+    FileDesc pipeIn(pipeFds[1]);
+    FileDesc pipeOut(pipeFds[0]);
+    // Larger pipe means fewer system calls, the default size is still fine
+    fcntl(pipeIn.fd, F_SETPIPE_SZ, pipeSize);
+
+    while (true)
+    {
+        ssize_t rc = splice(file.fd, nullptr, pipeIn.fd, nullptr, pipeSize,
+                            SPLICE_F_MOVE);
+        if (rc == 0)
+        {
+            break;
+        }
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return {};
+        }
+
+        // The hash is finalized by the send without the MORE flag
+        size_t pending = rc;
+        while (pending)
+        {
+            rc = splice(pipeOut.fd, nullptr, op.fd, nullptr, pending,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (rc <= 0)
+            {
+                if (rc == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                return {};
+            }
+            pending -= rc;
+        }
+    }
+
+    DigestValue digest(EVP_MD_size(hashStruct));
+    if (send(op.fd, nullptr, 0, 0) == -1 ||
+        read(op.fd, digest.data(), digest.size()) !=
+            static_cast<ssize_t>(digest.size()))
+    {
+        return {};
     }
 
-    return {PEM_read_bio_PUBKEY(keyBio.get(), nullptr, nullptr, nullptr),
-            &::EVP_PKEY_free};
+    return digest;
+}
+#endif // KERNEL_CRYPTO_SUPPORT
+
+void storeDigest(const std::string& filePath, const std::string& hashFunc,
+                 DigestValue&& digest)
+{
+    std::lock_guard<std::mutex> lock(digestsMutex);
+    digests[filePath] = {hashFunc, std::move(digest)};
+}
+
+void dropDigest(const std::string& filePath)
+{
+    std::lock_guard<std::mutex> lock(digestsMutex);
+    digests.erase(filePath);
 }
 
 bool verifyFile(const std::string& keyFile, const std::string& hashFunc,
@@ -128,25 +320,35 @@ bool verifyFile(const std::string& keyFile, const std::string& hashFunc,
         throw FwupdateError("Failed to find the Data or signature file.");
     }
 
-    // Create public key
-    auto publicKey = createPublicKey(keyFile);
-    if (!publicKey)
-    {
-        throw FwupdateError("Failed to create public key object.");
-    }
+    // Get public key and hash structure
+    auto& keyRing = KeyRing::instance();
+    auto publicKey = keyRing.getKey(keyFile);
+    auto hashStruct = keyRing.getDigest(hashFunc);
 
-    // Initializes a digest context.
-    EVP_MD_CTX_Ptr verifyCtx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    // Use the digest calculated in advance if it is available
+    std::unique_lock<std::mutex> lock(digestsMutex);
+    auto it = digests.find(filePath);
+    if (it != digests.end() && it->second.first == hashFunc)
+    {
+        const DigestValue digest = it->second.second;
+        lock.unlock();
 
-    // Adds all digest algorithms to the internal table
-    OpenSSL_add_all_digests();
+        auto signature = MappedMem::open(fileSig);
+        return verifyDigest(publicKey.get(), hashStruct, digest, signature);
+    }
+    lock.unlock();
 
-    // Create Hash structure.
-    auto hashStruct = EVP_get_digestbyname(hashFunc.c_str());
-    if (!hashStruct)
+#ifdef KERNEL_CRYPTO_SUPPORT
+    const DigestValue digest = kernelDigest(hashStruct, filePath);
+    if (!digest.empty())
     {
-        throw FwupdateError("EVP_get_digestbyname: Unknown message digest.");
+        auto signature = MappedMem::open(fileSig);
+        return verifyDigest(publicKey.get(), hashStruct, digest, signature);
     }
+#endif // KERNEL_CRYPTO_SUPPORT
+
+    // Initializes a digest context.
+    EVP_MD_CTX_Ptr verifyCtx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
 
     auto result = EVP_DigestVerifyInit(verifyCtx.get(), nullptr, hashStruct,
                                        nullptr, publicKey.get());
@@ -157,12 +359,14 @@ bool verifyFile(const std::string& keyFile, const std::string& hashFunc,
     }
 
     auto data = MappedMem::open(filePath);
-    result = EVP_DigestVerifyUpdate(verifyCtx.get(), data.get(), data.size());
-    if (result != 1)
-    {
-        throw FwupdateError("Error %lu occurred during EVP_DigestVerifyUpdate.",
-                            ERR_get_error());
-    }
+    data.stream([&verifyCtx](const uint8_t* window, size_t size) {
+        if (EVP_DigestVerifyUpdate(verifyCtx.get(), window, size) != 1)
+        {
+            throw FwupdateError(
+                "Error %lu occurred during EVP_DigestVerifyUpdate.",
+                ERR_get_error());
+        }
+    });
 
     auto signature = MappedMem::open(fileSig);
     result = EVP_DigestVerifyFinal(
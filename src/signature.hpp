@@ -5,7 +5,13 @@
 
 #pragma once
 
+#include <openssl/evp.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 /**
  * @brief Verify signature of specified file
@@ -20,3 +26,104 @@
  */
 bool verifyFile(const std::string& keyFile, const std::string& hashFunc,
                 const std::string& filePath);
+
+using DigestValue = std::vector<unsigned char>;
+
+/**
+ * @brief Cache of the public keys and the message digests.
+ *        Each key is parsed once per process and shared by all signature
+ *        checks.
+ */
+class KeyRing
+{
+  public:
+    using Key = std::shared_ptr<EVP_PKEY>;
+
+    KeyRing(const KeyRing&) = delete;
+    KeyRing& operator=(const KeyRing&) = delete;
+
+    /**
+     * @brief Get the key ring instance.
+     */
+    static KeyRing& instance();
+
+    /**
+     * @brief Get key object for the public key file.
+     *        Keys are cached by the file content, so the changed file is
+     *        loaded again.
+     *
+     * @param keyFile - path to publickey file
+     *
+     * @return Key object
+     *
+     * @throw FwupdateError in case of errors
+     */
+    Key getKey(const std::string& keyFile);
+
+    /**
+     * @brief Get message digest structure by the hash function name.
+     *
+     * @param hashFunc - hash function name
+     *
+     * @return Message digest structure
+     *
+     * @throw FwupdateError in case of unknown hash function
+     */
+    const EVP_MD* getDigest(const std::string& hashFunc);
+
+  private:
+    KeyRing();
+
+    std::mutex mutex;                         //! Cache guard
+    std::map<std::string, Key> keys;          //! PEM content -> key object
+    std::map<std::string, const EVP_MD*> mds; //! Hash function -> digest
+};
+
+/**
+ * @brief Incremental message digest calculator.
+ */
+class Digest
+{
+  public:
+    /**
+     * @brief Create digest context.
+     *
+     * @param hashFunc - hash function name
+     *
+     * @throw FwupdateError in case of unknown hash function
+     */
+    Digest(const std::string& hashFunc);
+
+    /**
+     * @brief Hash the next portion of data.
+     */
+    void update(const void* data, size_t size);
+
+    /**
+     * @brief Finalize calculation and get the digest value.
+     */
+    DigestValue final();
+
+  private:
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx;
+};
+
+/**
+ * @brief Store the file digest calculated in advance (e.g. while the file
+ *        was unpacked), so the verifyFile() doesn't read the file again.
+ *
+ * @param filePath - path to the file
+ * @param hashFunc - hash function used for the digest
+ * @param digest   - digest value
+ */
+void storeDigest(const std::string& filePath, const std::string& hashFunc,
+                 DigestValue&& digest);
+
+/**
+ * @brief Drop the file digest calculated in advance.
+ *        Must be called when the file is removed or replaced, otherwise the
+ *        digest of the previous content is used by verifyFile().
+ *
+ * @param filePath - path to the file
+ */
+void dropDigest(const std::string& filePath);
@@ -7,10 +7,17 @@
 
 #include "fwupderr.hpp"
 
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <array>
 #include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <cstring>
-#include <sstream>
 
 void checkWaitStatus(int wstatus, const std::string& output)
 {
@@ -36,29 +43,223 @@ void checkWaitStatus(int wstatus, const std::string& output)
 
 std::string exec(const char* cmd)
 {
-    FILE* pipe = popen(cmd, "r");
-    if (!pipe)
+    Subprocess proc(cmd);
+    const int rc = proc.wait();
+    auto output = proc.takeOutput();
+    checkWaitStatus(rc, output);
+
+    return output;
+}
+
+std::string exec(const std::vector<std::string>& args)
+{
+    Subprocess proc(args);
+    const int rc = proc.wait();
+    auto output = proc.takeOutput();
+    checkWaitStatus(rc, output);
+
+    return output;
+}
+
+Subprocess::Subprocess(const char* cmd, Output&& handler) :
+    command(cmd), handler(std::move(handler))
+{
+    const char* argv[] = {"sh", "-c", cmd, nullptr};
+    spawn("/bin/sh", argv);
+}
+
+Subprocess::Subprocess(const std::vector<std::string>& args,
+                       Output&& handler, int input) :
+    handler(std::move(handler))
+{
+    if (args.empty())
     {
-        throw FwupdateError("popen() failed, error=%d: %s", errno,
-                            strerror(errno));
+        throw FwupdateError("No command to execute");
     }
 
-    std::array<char, 512> buffer;
-    std::stringstream result;
-    while (fgets(buffer.data(), buffer.size(), pipe) != nullptr)
+    std::vector<const char*> argv;
+    for (const auto& arg : args)
     {
-        result << buffer.data();
+        command += command.empty() ? "" : " ";
+        command += arg;
+        argv.push_back(arg.c_str());
     }
+    argv.push_back(nullptr);
 
-    int rc = pclose(pipe);
-    if (rc == -1)
+    spawn(argv.front(), argv.data(), input);
+}
+
+void Subprocess::spawn(const char* path, const char* const argv[], int input)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
     {
-        throw FwupdateError("pclose() failed, error=%d: %s", errno,
+        throw FwupdateError("pipe() failed, error=%d: %s", errno,
                             strerror(errno));
     }
 
-    auto output = result.str();
-    checkWaitStatus(rc, output);
+    // The duplicated descriptor is inherited, the original ones are closed
+    // on exec
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    if (input != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+    }
 
-    return output;
+    const int rc = posix_spawn(&pid, path, &actions, nullptr,
+                               const_cast<char* const*>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0)
+    {
+        close(fds[0]);
+        pid = -1;
+        throw FwupdateError("posix_spawn() failed, error=%d: %s", rc,
+                            strerror(rc));
+    }
+    out = fds[0];
+}
+
+Subprocess::~Subprocess()
+{
+    reap(true);
+}
+
+int Subprocess::fd() const
+{
+    return out;
+}
+
+int Subprocess::wait(int timeout)
+{
+    return waitAll({this}, timeout).front();
+}
+
+std::string Subprocess::takeOutput()
+{
+    return std::move(output);
+}
+
+std::vector<int> Subprocess::waitAll(const std::vector<Subprocess*>& procs,
+                                     int timeout)
+{
+    using namespace std::chrono;
+    const auto deadline = steady_clock::now() + milliseconds(timeout);
+
+    try
+    {
+        std::vector<pollfd> fds;
+        std::vector<Subprocess*> active;
+        while (true)
+        {
+            fds.clear();
+            active.clear();
+            for (auto proc : procs)
+            {
+                if (proc->out != -1)
+                {
+                    fds.push_back({proc->out, POLLIN, 0});
+                    active.push_back(proc);
+                }
+            }
+            if (fds.empty())
+            {
+                break;
+            }
+
+            int wait = -1;
+            if (timeout)
+            {
+                wait = duration_cast<milliseconds>(deadline -
+                                                   steady_clock::now())
+                           .count();
+                if (wait <= 0)
+                {
+                    throw FwupdateError("%s: timed out",
+                                        active.front()->command.c_str());
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), wait) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw FwupdateError("poll() failed, error=%d: %s", errno,
+                                    strerror(errno));
+            }
+            for (size_t i = 0; i < fds.size(); ++i)
+            {
+                if (fds[i].revents)
+                {
+                    active[i]->readOutput();
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        for (auto proc : procs)
+        {
+            proc->reap(true);
+        }
+        throw;
+    }
+
+    // The output is closed, the commands are exiting
+    std::vector<int> statuses;
+    for (auto proc : procs)
+    {
+        proc->reap(false);
+        statuses.push_back(proc->status);
+    }
+    return statuses;
+}
+
+void Subprocess::readOutput()
+{
+    std::array<char, 4096> buffer;
+    const ssize_t rc = read(out, buffer.data(), buffer.size());
+    if (rc == -1 && errno == EINTR)
+    {
+        return;
+    }
+    if (rc <= 0)
+    {
+        close(out);
+        out = -1;
+        return;
+    }
+
+    if (handler)
+    {
+        handler(buffer.data(), rc);
+    }
+    else
+    {
+        output.append(buffer.data(), rc);
+    }
+}
+
+void Subprocess::reap(bool kill)
+{
+    if (out != -1)
+    {
+        close(out);
+        out = -1;
+    }
+    if (pid != -1)
+    {
+        if (kill)
+        {
+            ::kill(pid, SIGKILL);
+        }
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        {
+        }
+        pid = -1;
+    }
 }
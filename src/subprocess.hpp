@@ -7,10 +7,16 @@
 
 #include "strfmt.hpp"
 
+#include <sys/types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
 /**
  * @brief Check wait status and throw exception if child failed.
  *
- * @param wstatus - status returned by pclose()/system()/waitpid().
+ * @param wstatus - status returned by Subprocess::wait() or waitpid().
  * @param output  - last command output to include in exception message.
  */
 void checkWaitStatus(int wstatus, const std::string& output);
@@ -29,3 +35,130 @@ std::string exec(const char* fmt, Args&&... args)
 {
     return exec(strfmt(fmt, std::forward<Args>(args)...).c_str());
 }
+
+/**
+ * @brief Execute the external command without the shell, the arguments
+ *        are passed as is.
+ *
+ * @param args - Path to the command and its arguments
+ *
+ * @return command output
+ */
+std::string exec(const std::vector<std::string>& args);
+
+/**
+ * @brief External command running in background.
+ *        The command is started through posix_spawn(), by the shell or
+ *        directly, its standard output is read through the pipe as it
+ *        arrives.
+ */
+class Subprocess
+{
+  public:
+    /**
+     * @brief Handler of the command output, called for each portion of the
+     *        data as soon as it is read.
+     */
+    using Output = std::function<void(const char* data, size_t size)>;
+
+    Subprocess(const Subprocess&) = delete;
+    Subprocess& operator=(const Subprocess&) = delete;
+
+    /**
+     * @brief Start the external command.
+     *
+     * @param cmd     - Command and its arguments
+     * @param handler - output handler, the output is collected if not set
+     *
+     * @throw FwupdateError in case of errors
+     */
+    Subprocess(const char* cmd, Output&& handler = nullptr);
+
+    /**
+     * @brief Start the external command without the shell.
+     *        The arguments are passed as is, so they don't need quoting.
+     *
+     * @param args    - Path to the command and its arguments
+     * @param handler - output handler, the output is collected if not set
+     * @param input   - descriptor to use as the command input, -1 to keep
+     *                  the input of this process
+     *
+     * @throw FwupdateError in case of errors
+     */
+    Subprocess(const std::vector<std::string>& args,
+               Output&& handler = nullptr, int input = -1);
+
+    /**
+     * @brief Kill the command if it wasn't waited.
+     */
+    ~Subprocess();
+
+    /**
+     * @brief Get descriptor to read the command output directly.
+     *        The output that is not read by the caller is passed to the
+     *        handler on wait.
+     */
+    int fd() const;
+
+    /**
+     * @brief Read the rest of output and wait for the command completion.
+     *
+     * @param timeout - timeout in milliseconds, 0 to wait infinitely
+     *
+     * @return wait status of the command
+     *
+     * @throw FwupdateError in case of errors or timeout
+     */
+    int wait(int timeout = 0);
+
+    /**
+     * @brief Get the collected output, the buffer is moved to the caller.
+     */
+    std::string takeOutput();
+
+    /**
+     * @brief Read the rest of output of several commands running in parallel
+     *        and wait for their completion.
+     *
+     * @param procs   - running commands
+     * @param timeout - timeout in milliseconds, 0 to wait infinitely
+     *
+     * @return wait statuses of the commands
+     *
+     * @throw FwupdateError in case of errors or timeout, all commands that
+     *        are still running are killed
+     */
+    static std::vector<int> waitAll(const std::vector<Subprocess*>& procs,
+                                    int timeout = 0);
+
+  private:
+    /**
+     * @brief Spawn the process with the output redirected to the pipe.
+     *
+     * @param path  - path to the executable
+     * @param argv  - null terminated list of the arguments
+     * @param input - descriptor to use as the input, -1 to keep the input
+     *
+     * @throw FwupdateError in case of errors
+     */
+    void spawn(const char* path, const char* const argv[], int input = -1);
+
+    /**
+     * @brief Read the available output.
+     */
+    void readOutput();
+
+    /**
+     * @brief Wait for the command exit.
+     *
+     * @param kill - flag to kill the command first
+     */
+    void reap(bool kill);
+
+    std::string command; //! Command line
+    Output handler;      //! Output handler
+    std::string output;  //! Collected output
+    pid_t pid = -1;      //! Process id, -1 if the process was reaped
+    int out = -1;        //! Read end of the output pipe
+    int status = 0;      //! Wait status of the command
+};
@@ -0,0 +1,326 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "tar.hpp"
+
+#include "fwupderr.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+static constexpr size_t blockSize = 512;
+
+/**
+ * @brief POSIX ustar header.
+ */
+struct TarHeader
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+static_assert(sizeof(TarHeader) == blockSize, "Invalid TAR header size");
+
+/**
+ * @brief Parse octal numeric field of the header.
+ */
+static size_t parseOctal(const char* field, size_t len)
+{
+    size_t ret = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+    {
+        ++i;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    {
+        ret = (ret << 3) | static_cast<size_t>(field[i] - '0');
+    }
+    return ret;
+}
+
+/**
+ * @brief Get string from the fixed size header field.
+ */
+static std::string fieldStr(const char* field, size_t len)
+{
+    return std::string(field, strnlen(field, len));
+}
+
+/**
+ * @brief Check the ustar magic and the header checksum.
+ */
+static bool isValidHeader(const TarHeader& hdr)
+{
+    if (memcmp(hdr.magic, "ustar", 5) != 0)
+    {
+        return false;
+    }
+
+    // Checksum is calculated with chksum field filled by spaces
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&hdr);
+    size_t sum = 0;
+    for (size_t i = 0; i < sizeof(hdr); ++i)
+    {
+        sum += bytes[i];
+    }
+    for (const auto& c : hdr.chksum)
+    {
+        sum -= static_cast<unsigned char>(c);
+        sum += ' ';
+    }
+
+    return sum == parseOctal(hdr.chksum, sizeof(hdr.chksum));
+}
+
+/**
+ * @brief Check if header block is filled by zeros (end of archive marker).
+ */
+static bool isZeroBlock(const TarHeader& hdr)
+{
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&hdr);
+    for (size_t i = 0; i < sizeof(hdr); ++i)
+    {
+        if (bytes[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Get path value from PAX extended header records.
+ *        Each record looks like "%d path=%s\n".
+ */
+static std::string paxPath(const std::string& records)
+{
+    static const std::string pathKey = "path=";
+
+    std::string ret;
+    size_t pos = 0;
+    while (pos < records.size())
+    {
+        size_t len = 0;
+        size_t i = pos;
+        for (; i < records.size() && records[i] >= '0' && records[i] <= '9';
+             ++i)
+        {
+            len = len * 10 + static_cast<size_t>(records[i] - '0');
+        }
+        if (len == 0 || i >= records.size() || records[i] != ' ' ||
+            pos + len > records.size())
+        {
+            break;
+        }
+
+        const size_t keyPos = i + 1;
+        const size_t end = pos + len - 1; // trailing '\n'
+        if (records.compare(keyPos, pathKey.size(), pathKey) == 0 &&
+            keyPos + pathKey.size() <= end)
+        {
+            ret = records.substr(keyPos + pathKey.size(),
+                                 end - keyPos - pathKey.size());
+        }
+        pos += len;
+    }
+
+    return ret;
+}
+
+TarReader::TarReader(const fs::path& file) :
+    fd(open(file.c_str(), O_RDONLY | O_CLOEXEC)), owner(true)
+{
+    if (fd == -1)
+    {
+        throw FwupdateError("open %s failed, error=%d: %s", file.c_str(), errno,
+                            strerror(errno));
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+TarReader::TarReader(int fd) : fd(fd), owner(false)
+{
+}
+
+TarReader::~TarReader()
+{
+    if (owner)
+    {
+        close(fd);
+    }
+}
+
+bool TarReader::isTar(int fd)
+{
+    TarHeader hdr;
+    return pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+           isValidHeader(hdr);
+}
+
+bool TarReader::next(Member& member)
+{
+    skip(remain + padding);
+    remain = 0;
+    padding = 0;
+
+    std::string longName;
+    while (true)
+    {
+        TarHeader hdr;
+        if (!readFull(&hdr, sizeof(hdr)) || isZeroBlock(hdr))
+        {
+            return false;
+        }
+        if (!isValidHeader(hdr))
+        {
+            throw FwupdateError("Invalid TAR header");
+        }
+
+        const size_t size = parseOctal(hdr.size, sizeof(hdr.size));
+        const size_t pad = (blockSize - size % blockSize) % blockSize;
+
+        if (hdr.typeflag == 'L' || hdr.typeflag == 'x')
+        {
+            // GNU long name or PAX extended header for the next member
+            auto data = readString(size);
+            skip(pad);
+            longName = hdr.typeflag == 'L' ? fieldStr(data.data(), data.size())
+                                           : paxPath(data);
+            continue;
+        }
+        if (hdr.typeflag == 'g' || hdr.typeflag == 'K')
+        {
+            // PAX global header or GNU long link name, not used here
+            skip(size + pad);
+            continue;
+        }
+
+        if (!longName.empty())
+        {
+            member.name = longName;
+        }
+        else
+        {
+            member.name = fieldStr(hdr.name, sizeof(hdr.name));
+            if (hdr.prefix[0])
+            {
+                member.name = fieldStr(hdr.prefix, sizeof(hdr.prefix)) + '/' +
+                              member.name;
+            }
+        }
+        while (member.name.compare(0, 2, "./") == 0)
+        {
+            member.name.erase(0, 2);
+        }
+        member.size = size;
+        member.type = hdr.typeflag;
+
+        // Only regular files have data in the archive
+        if (member.isFile())
+        {
+            remain = size;
+            padding = pad;
+        }
+        return true;
+    }
+}
+
+size_t TarReader::read(void* buf, size_t len)
+{
+    len = std::min(len, remain);
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (!readFull(buf, len))
+    {
+        throw FwupdateError("Unexpected end of TAR archive");
+    }
+    remain -= len;
+    return len;
+}
+
+bool TarReader::readFull(void* buf, size_t len)
+{
+    auto* ptr = static_cast<uint8_t*>(buf);
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t rc = ::read(fd, ptr + done, len - done);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw FwupdateError("Reading TAR archive failed, error=%d: %s",
+                                errno, strerror(errno));
+        }
+        if (rc == 0)
+        {
+            if (done == 0)
+            {
+                return false;
+            }
+            throw FwupdateError("Unexpected end of TAR archive");
+        }
+        done += static_cast<size_t>(rc);
+    }
+    return true;
+}
+
+void TarReader::skip(size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    if (lseek(fd, static_cast<off_t>(len), SEEK_CUR) != -1)
+    {
+        return;
+    }
+
+    // Not seekable stream (pipe)
+    std::array<uint8_t, 64 * 1024> buf;
+    while (len)
+    {
+        const size_t chunk = std::min(len, buf.size());
+        if (!readFull(buf.data(), chunk))
+        {
+            throw FwupdateError("Unexpected end of TAR archive");
+        }
+        len -= chunk;
+    }
+}
+
+std::string TarReader::readString(size_t size)
+{
+    std::string ret(size, '\0');
+    if (size && !readFull(ret.data(), size))
+    {
+        throw FwupdateError("Unexpected end of TAR archive");
+    }
+    return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Streaming reader of the TAR archive.
+ *        Supports POSIX ustar format with GNU and PAX long names.
+ *        Members are read sequentially, member data goes straight
+ *        into the caller buffer.
+ */
+class TarReader
+{
+  public:
+    /**
+     * @brief Archive member description.
+     */
+    struct Member
+    {
+        std::string name; //! Member name without leading "./"
+        size_t size;      //! Size of member data in bytes
+        char type;        //! Type of member ('0' for regular file)
+
+        /**
+         * @brief Check if member is a regular file
+         */
+        bool isFile() const
+        {
+            return type == '0' || type == '\0' || type == '7';
+        }
+    };
+
+    TarReader(const TarReader&) = delete;
+    TarReader& operator=(const TarReader&) = delete;
+
+    /**
+     * @brief Open archive file.
+     *
+     * @param file - path to the archive
+     *
+     * @throw FwupdateError in case of errors
+     */
+    TarReader(const fs::path& file);
+
+    /**
+     * @brief Use already opened stream, the descriptor is not closed.
+     *
+     * @param fd - file descriptor to read archive from
+     */
+    TarReader(int fd);
+
+    ~TarReader();
+
+    /**
+     * @brief Check if the file looks like an ustar archive.
+     *        The header is read at the start of the file, the file offset
+     *        is not changed.
+     *
+     * @param fd - descriptor of the file
+     *
+     * @return true if the first header has valid ustar magic and checksum
+     */
+    static bool isTar(int fd);
+
+    /**
+     * @brief Move to the next archive member.
+     *        Unread data of the current member is skipped.
+     *
+     * @param member - structure to fill with member description
+     *
+     * @return false if end of archive reached
+     *
+     * @throw FwupdateError in case of errors
+     */
+    bool next(Member& member);
+
+    /**
+     * @brief Read data of the current member.
+     *
+     * @param buf - destination buffer
+     * @param len - size of the buffer
+     *
+     * @return number of read bytes, 0 on the end of member data
+     *
+     * @throw FwupdateError in case of errors
+     */
+    size_t read(void* buf, size_t len);
+
+  private:
+    /**
+     * @brief Read exactly specified number of bytes from the archive.
+     *
+     * @return false if the stream ended before any byte was read
+     */
+    bool readFull(void* buf, size_t len);
+
+    /**
+     * @brief Skip specified number of bytes in the archive.
+     */
+    void skip(size_t len);
+
+    /**
+     * @brief Read data of the extended header member into string.
+     */
+    std::string readString(size_t size);
+
+    int fd;             //! Archive file descriptor
+    bool owner;         //! Flag to close descriptor in destructor
+    size_t remain = 0;  //! Remaining data of the current member
+    size_t padding = 0; //! Block padding after the current member data
+};
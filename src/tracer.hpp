@@ -5,8 +5,15 @@
 
 #pragma once
 
+#include "strfmt.hpp"
+
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
 
 constexpr auto TITLE_WIDTH = 40;
 
@@ -14,6 +21,15 @@ constexpr auto TITLE_WIDTH = 40;
  * @brief RAII task tracer.
  *        It print task title and wait for completion.
  *        If completion wouldn't called this task show fail state.
+ *
+ *        When tasks are running in several threads each thread sets its own
+ *        prefix, and every trace is printed as a separate prefixed line.
+ *
+ *        Each completed task can be recorded into the statistics file as a
+ *        JSON line with its duration and number of processed bytes.
+ *
+ *        The listener gets every state change of the tasks, it is used to
+ *        report the progress to the remote clients.
  */
 struct Tracer
 {
@@ -29,15 +45,95 @@ struct Tracer
      * @param args - optional arguments
      */
     template <typename... Args>
-    Tracer(const char* fmt, Args&&... args)
+    Tracer(const char* fmt, Args&&... args) :
+        Tracer(strfmt(fmt, std::forward<Args>(args)...))
+    {
+    }
+    Tracer(const char* msg) : Tracer(std::string(msg))
     {
-        int offset = printf(fmt, std::forward<Args>(args)...);
-        printf(" %*s ", offset - TITLE_WIDTH, "...");
     }
-    Tracer(const char* msg)
+
+    /**
+     * @brief Set prefix for traces of the current thread.
+     *
+     * @param name - prefix, empty string to disable line mode
+     */
+    static void setPrefix(const std::string& name)
     {
-        int offset = strlen(msg);
-        printf("%s %*s ", msg, offset - TITLE_WIDTH, "...");
+        prefix() = name;
+    }
+
+    /**
+     * @brief Set output stream for the statistics records.
+     *
+     * @param file - opened stream, nullptr to disable statistics
+     */
+    static void setStatsFile(FILE* file)
+    {
+        stats() = file;
+    }
+
+    /**
+     * @brief Listener of the task state changes.
+     *        It gets the task title and the state: empty string when the task
+     *        is started, percentage of the progress, and the final status.
+     */
+    using Listener =
+        std::function<void(const std::string& title, const std::string& state)>;
+
+    /**
+     * @brief Set listener of the task state changes.
+     *
+     * @param callback - listener function, nullptr to disable
+     */
+    static void setListener(Listener&& callback)
+    {
+        listener() = std::move(callback);
+    }
+
+    /**
+     * @brief Account bytes processed by the task.
+     *
+     * @param size - number of bytes
+     */
+    void addBytes(size_t size)
+    {
+        bytes += size;
+    }
+
+    /**
+     * @brief Show progress of the task.
+     *        The percentage is overwritten by the final status.
+     *
+     * @param current - number of processed units
+     * @param total   - total number of units
+     */
+    void progress(size_t current, size_t total)
+    {
+        const int percent =
+            total ? static_cast<int>(current * 100 / total) : 100;
+        if (percent == lastPercent)
+        {
+            return;
+        }
+
+        if (listener() && percent != lastNotified)
+        {
+            listener()(title.c_str(), strfmt("%d%%", percent).c_str());
+            lastNotified = percent;
+        }
+
+        if (prefix().empty())
+        {
+            printf("%3d%%\b\b\b\b", percent);
+            lastPercent = percent;
+        }
+        else if (percent / 10 != lastPercent / 10)
+        {
+            // Don't flood the shared output
+            print(strfmt("%3d%%", percent).c_str());
+            lastPercent = percent;
+        }
     }
 
     /**
@@ -48,6 +144,14 @@ struct Tracer
         complete(" OK ");
     }
 
+    /**
+     * @brief Complete task with state 'skipped'
+     */
+    void skip()
+    {
+        complete("SKIP");
+    }
+
     /**
      * @brief Complete trace with status 'fail'
      */
@@ -65,14 +169,169 @@ struct Tracer
     }
 
   private:
+    Tracer(std::string&& text) : title(std::move(text))
+    {
+        if (prefix().empty())
+        {
+            int offset = strlen(title.c_str());
+            printf("%s %*s ", title.c_str(), offset - TITLE_WIDTH, "...");
+        }
+        else
+        {
+            print("");
+        }
+
+        if (listener())
+        {
+            listener()(title.c_str(), std::string());
+        }
+    }
+
     /**
      * @brief Complete trace and print status
      */
     void complete(const char* status)
     {
-        printf("[%s]\n", status);
+        if (prefix().empty())
+        {
+            printf("[%s]\n", status);
+        }
+        else
+        {
+            print(strfmt("[%s]", status).c_str());
+        }
         completed = true;
+
+        if (stats())
+        {
+            record(status);
+        }
+
+        if (listener())
+        {
+            listener()(title.c_str(), trim(status));
+        }
+    }
+
+    /**
+     * @brief Write the statistics record of the completed task.
+     */
+    void record(const char* status)
+    {
+        using seconds = std::chrono::duration<double>;
+        const auto end = std::chrono::steady_clock::now();
+        const double duration = seconds(end - start).count();
+        const double throughput = duration > 0 ? bytes / duration : 0;
+
+        const std::string state = trim(status);
+
+        std::lock_guard<std::mutex> lock(outputMutex());
+        fprintf(stats(),
+                "{\"step\":\"%s\",\"thread\":\"%s\",\"status\":\"%s\","
+                "\"start\":%.6f,\"duration\":%.6f,\"bytes\":%zu,"
+                "\"throughput\":%.0f}\n",
+                escape(title).c_str(), escape(prefix()).c_str(), state.c_str(),
+                seconds(started.time_since_epoch()).count(), duration, bytes,
+                throughput);
+        fflush(stats());
+    }
+
+    /**
+     * @brief Remove the padding spaces from the status.
+     */
+    static std::string trim(const char* status)
+    {
+        std::string ret(status);
+        ret.erase(0, ret.find_first_not_of(' '));
+        ret.erase(ret.find_last_not_of(' ') + 1);
+        return ret;
+    }
+
+    /**
+     * @brief Escape string to use it as JSON value.
+     */
+    static std::string escape(const std::string& str)
+    {
+        std::string ret;
+        // Formatted strings may keep the terminating null inside
+        for (const char* c = str.c_str(); *c; ++c)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                ret += '\\';
+                ret += *c;
+            }
+            else if (static_cast<unsigned char>(*c) < ' ')
+            {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", *c);
+                ret += code;
+            }
+            else
+            {
+                ret += *c;
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Print the whole trace line in the line mode.
+     */
+    void print(const char* status)
+    {
+        std::lock_guard<std::mutex> lock(outputMutex());
+
+        int offset = strlen(prefix().c_str()) + strlen(title.c_str()) + 3;
+        printf("[%s] %s %*s %s\n", prefix().c_str(), title.c_str(),
+               offset - TITLE_WIDTH, "...", status);
+    }
+
+    /**
+     * @brief Prefix of the traces of the current thread.
+     */
+    static std::string& prefix()
+    {
+        static thread_local std::string name;
+        return name;
+    }
+
+    /**
+     * @brief Stream for the statistics records.
+     */
+    static FILE*& stats()
+    {
+        static FILE* file = nullptr;
+        return file;
+    }
+
+    /**
+     * @brief Listener of the task state changes.
+     */
+    static Listener& listener()
+    {
+        static Listener callback;
+        return callback;
+    }
+
+    /**
+     * @brief Lock of the shared output.
+     */
+    static std::mutex& outputMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
     }
 
+    std::string title;
     bool completed = false;
+    int lastPercent = -1;
+    int lastNotified = -1; //! Last percentage sent to the listener
+    size_t bytes = 0; //! Number of processed bytes
+    //! Start of the task for measuring the duration
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    //! Wall clock time of the start, comparable across the runs
+    std::chrono::system_clock::time_point started =
+        std::chrono::system_clock::now();
 };
@@ -0,0 +1,77 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#include "verifier.hpp"
+
+#include "signature.hpp"
+
+#include <algorithm>
+
+Verifier::Verifier(size_t threads)
+{
+    for (size_t i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&Verifier::worker, this);
+    }
+}
+
+Verifier::~Verifier()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+}
+
+Verifier& Verifier::instance()
+{
+    static Verifier verifier(std::max(1u, std::thread::hardware_concurrency()));
+    return verifier;
+}
+
+Verifier::Result Verifier::submit(const fs::path& publicKey,
+                                  const std::string& hashFunc,
+                                  const fs::path& file)
+{
+    std::packaged_task<bool()> job(
+        [publicKey, hashFunc, file]() {
+            return verifyFile(publicKey, hashFunc, file);
+        });
+    Result result = job.get_future().share();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.emplace_back(std::move(job));
+    }
+    cv.notify_one();
+
+    return result;
+}
+
+void Verifier::worker()
+{
+    while (true)
+    {
+        std::packaged_task<bool()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+            if (jobs.empty())
+            {
+                // Stop requested and there is nothing to do
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
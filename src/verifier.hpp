@@ -0,0 +1,69 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2021 YADRO.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Scheduler of the signature checks.
+ *        Checks are executed by the pool of threads sized to the number of
+ *        CPU cores.
+ */
+class Verifier
+{
+  public:
+    using Result = std::shared_future<bool>;
+
+    Verifier(const Verifier&) = delete;
+    Verifier& operator=(const Verifier&) = delete;
+
+    ~Verifier();
+
+    /**
+     * @brief Get the scheduler instance.
+     */
+    static Verifier& instance();
+
+    /**
+     * @brief Schedule the signature check of specified file.
+     *
+     * @param publicKey - path to public key file
+     * @param hashFunc  - signature hash function
+     * @param file      - path to the file for verification
+     *
+     * @return Result of verifyFile() call, exceptions are passed through
+     */
+    Result submit(const fs::path& publicKey, const std::string& hashFunc,
+                  const fs::path& file);
+
+  private:
+    /**
+     * @brief Constructor.
+     *
+     * @param threads - number of worker threads
+     */
+    Verifier(size_t threads);
+
+    /**
+     * @brief Worker thread routine.
+     */
+    void worker();
+
+    std::vector<std::thread> workers;            //! Worker threads
+    std::deque<std::packaged_task<bool()>> jobs; //! Queue of scheduled jobs
+    std::mutex mutex;                            //! Queue guard
+    std::condition_variable cv;                  //! Queue notification
+    bool stop = false;                           //! Flag to stop workers
+};